@@ -1,14 +1,76 @@
 #pragma once
 
 #include <multiformats/common.h>
+#include <p2p/connection.h>
+#include <p2p/protocol.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// https://github.com/multiformats/multistream-select
 
 namespace multiformats {
 namespace multistream {
 
+    // The protocol of the negotiation itself, the first message of both sides
+    extern const std::string protocol_id;
+
+    // The messages: the line and its '\n', after their uvarint length
+    std::string encode(const std::string& line);
+
+    //
+    // dialer proposes protocols to the listener at the other end of a connection, in turn, until it
+    //   accepts one. The connection given back reads what the listener sends after its answer.
+    //   A refused protocol fails with protocol_not_supported, an answer out of the protocol with protocol_error.
+    //
     class dialer {
+    public:
+        using select_handler_t = std::function<void(std::error_code, std::shared_ptr<p2p::connection>, const std::string& protocol)>;
+
+        // Negotiate one of the protocols: one round trip, and one more by protocol refused.
+        //   The handler runs on the io thread of the connection.
+        static void select(std::shared_ptr<p2p::connection> conn, const std::vector<std::string>& protocols, const select_handler_t& handler);
+
+        // Assume the listener accepts the protocol: the proposal goes out in the first write on the
+        //   connection returned (or before its first read), and the first read checks the answer.
+        //   No round trip: a refused protocol fails the first read, and closes the connection.
+        static std::shared_ptr<p2p::connection> select_lazy(std::shared_ptr<p2p::connection> conn, const std::string& protocol);
+    };
 
+    class negotiation;
+
+    //
+    // listener answers the proposals of the dialers with the protocols it handles, and gives each
+    //   connection to the handler of the protocol accepted.
+    //   The dialer may ask for the list of the protocols ("ls").
+    //   The protocols may be patterns, a semver range or a prefix (see p2p/protocol.h).
+    //
+    class listener : public std::enable_shared_from_this<listener> {
     public:
-        void handle() {};
+        using handler_t  = std::function<void(std::shared_ptr<p2p::connection>, const std::string& protocol)>;
+        using fallback_t = std::function<void(std::shared_ptr<p2p::connection>)>;
+
+        listener();
+        // Accept the protocols of a table shared with others, e.g. the switch of a node
+        explicit listener(std::shared_ptr<p2p::protocol_table> handlers);
+
+        void add(const std::string& protocol, const handler_t& handler);
+        void remove(const std::string& protocol);
+
+        std::vector<std::string> protocols() const;
+
+        // Negotiate the protocol of an accepted connection: closed when the dialer sends something else
+        //   than proposals, the handler runs on its io thread. A connection that does not start with
+        //   the negotiation goes to the fallback instead, when there is one, the bytes received included.
+        void handle(std::shared_ptr<p2p::connection> conn, const fallback_t& fallback = {});
+
+    private:
+        friend class negotiation;
+
+        bool find(const std::string& protocol, handler_t& handler) const;
+
+        std::shared_ptr<p2p::protocol_table> _handlers;
     };
 }
 }
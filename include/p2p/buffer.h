@@ -0,0 +1,207 @@
+#pragma once
+
+#include "core.h"
+#include <multiformats/common.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace p2p {
+
+    class buffer_pool;
+
+    namespace details {
+        // Header of a pooled block, followed by its bytes
+        struct buffer_block {
+            std::atomic<size_t> refs;
+            size_t              capacity;
+            buffer_pool*        pool;
+        };
+    }
+
+    //
+    // shared_buffer is a refcounted handle on a block of memory owned by a buffer_pool.
+    //   Copying a handle is cheap, the block goes back to its pool when the last handle is released.
+    //
+    class shared_buffer {
+    public:
+        shared_buffer() : _block(nullptr), _size(0) {}
+
+        shared_buffer(const shared_buffer& other) : _block(other._block), _size(other._size)
+        {
+            if (_block) _block->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        shared_buffer(shared_buffer&& other) noexcept : _block(other._block), _size(other._size)
+        {
+            other._block = nullptr;
+            other._size = 0;
+        }
+
+        shared_buffer& operator=(shared_buffer other) noexcept
+        {
+            std::swap(_block, other._block);
+            std::swap(_size, other._size);
+            return *this;
+        }
+
+        ~shared_buffer()
+        {
+            release();
+        }
+
+        inline byte*  data()     const { return _block ? reinterpret_cast<byte*>(_block + 1) : nullptr; }
+        inline size_t capacity() const { return _block ? _block->capacity : 0; }
+
+        // Number of bytes in use, set by the owner of the handle
+        inline size_t size()     const { return _size; }
+        inline void   resize(size_t size) { _size = (std::min)(size, capacity()); }
+
+        inline multiformats::bufferview_t view() const { return { data(), static_cast<std::ptrdiff_t>(_size) }; }
+
+        // True when this handle is the only one on its block
+        inline bool unique() const { return _block && _block->refs.load(std::memory_order_acquire) == 1; }
+
+        explicit operator bool() const { return _block != nullptr; }
+
+    private:
+        friend class buffer_pool;
+        using block = details::buffer_block;
+
+        explicit shared_buffer(block* b) : _block(b), _size(0) {}
+
+        void release();
+
+        block* _block;
+        size_t _size;
+    };
+
+
+    //
+    // borrowed_buffer gives a read handler a view on the bytes received by a connection, without copying them.
+    //   The view holds a reference on the block: while it lives, the connection receives into another one,
+    //   so a handler may read again before it is done with the bytes. Take a handle with retain() to keep
+    //   the bytes after the handler.
+    //
+    class borrowed_buffer {
+    public:
+        borrowed_buffer() = default;
+        borrowed_buffer(const shared_buffer& buffer, size_t size) : _buffer(buffer), _size(size) {}
+        borrowed_buffer(const shared_buffer& buffer, size_t offset, size_t size) : _buffer(buffer), _offset(offset), _size(size) {}
+
+        inline const byte* data()  const { return _buffer ? _buffer.data() + _offset : nullptr; }
+        inline size_t      size()  const { return _size; }
+        inline bool        empty() const { return _size == 0; }
+
+        inline const byte* begin() const { return data(); }
+        inline const byte* end()   const { return data() + _size; }
+
+        inline multiformats::bufferview_t view() const { return { data(), static_cast<std::ptrdiff_t>(_size) }; }
+
+        // The view on `size` bytes from `offset` of this one
+        inline borrowed_buffer slice(size_t offset, size_t size) const
+        {
+            return _buffer ? borrowed_buffer{ _buffer, _offset + offset, size } : borrowed_buffer{};
+        }
+
+        // Keep the underlying pooled buffer alive; the connection then reads into a new one.
+        //   A view that does not start the buffer is copied into a new one instead.
+        inline shared_buffer retain() const;
+
+    private:
+        shared_buffer _buffer;
+        size_t        _offset = 0;
+        size_t        _size = 0;
+    };
+
+
+    //
+    // buffer_pool recycles the network buffers of the connections.
+    //   Requests are rounded up to a power-of-two size class, from 256 B to 1 MiB, each class
+    //   with its own free list. The global pool also gives every thread a small cache, bounded in
+    //   bytes, so an io thread mostly allocates and releases its buffers without taking a lock.
+    //   Past max_idle_bytes, released blocks go back to the heap: the pool shrinks after a burst.
+    //   Larger requests go straight to the heap.
+    //
+    class buffer_pool {
+    public:
+        static const size_t min_block_size = 256;
+        static const size_t max_block_size = 1024 * 1024;
+        static const size_t size_classes   = 13;
+
+        struct stats_t {
+            size_t in_use_blocks     = 0;   // blocks currently held by handles
+            size_t in_use_bytes      = 0;
+            size_t high_water_blocks = 0;   // most blocks ever held at the same time
+            size_t high_water_bytes  = 0;
+            size_t heap_bytes        = 0;   // bytes obtained from the heap: in use + idle in the free lists
+            size_t idle_bytes        = 0;   // bytes idle in the shared free lists (not in the thread caches)
+        };
+
+        // The pool shared by all the connections of the process
+        static buffer_pool& global();
+
+        // max_idle_bytes: most bytes kept in the free lists
+        explicit buffer_pool(size_t max_idle_bytes = 64 * 1024 * 1024) : buffer_pool(max_idle_bytes, 0) {}
+        ~buffer_pool();
+
+        buffer_pool(const buffer_pool&) = delete;
+        buffer_pool& operator=(const buffer_pool&) = delete;
+
+        // Get a buffer of at least `capacity` bytes
+        shared_buffer allocate(size_t capacity);
+
+        // Copy `bytes` into a new buffer
+        shared_buffer copy(multiformats::bufferview_t bytes);
+
+        stats_t stats() const;
+
+        // Index of the size class serving `capacity`, and the block size of a class
+        static size_t size_class(size_t capacity);
+        static size_t class_size(size_t index) { return min_block_size << index; }
+
+    private:
+        friend class shared_buffer;
+        using block = details::buffer_block;
+
+        // thread_cache: bytes of free blocks kept by every thread (global pool only,
+        //   the caches return their blocks to it when their thread exits)
+        buffer_pool(size_t max_idle_bytes, size_t thread_cache);
+
+        void recycle(block* b);
+        void push_free(block* b);
+        void on_acquire(size_t bytes);
+
+        struct thread_cache;
+        static thread_local thread_cache _cache;
+
+        struct free_list {
+            std::mutex          mutex;
+            std::vector<block*> blocks;
+        };
+
+        size_t                              _max_idle_bytes;
+        size_t                              _thread_cache;
+        std::array<free_list, size_classes> _free;
+
+        std::atomic<size_t> _in_use_blocks;
+        std::atomic<size_t> _in_use_bytes;
+        std::atomic<size_t> _high_water_blocks;
+        std::atomic<size_t> _high_water_bytes;
+        std::atomic<size_t> _heap_bytes;
+        std::atomic<size_t> _idle_bytes;
+    };
+
+
+    shared_buffer borrowed_buffer::retain() const
+    {
+        if (_offset) return buffer_pool::global().copy(view());
+
+        auto handle = _buffer;
+        handle.resize(_size);
+        return handle;
+    }
+
+}
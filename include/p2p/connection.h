@@ -2,12 +2,27 @@
 
 #include <multiformats\multiaddr.h>
 #include <p2p\peer.h>
+#include <p2p\buffer.h>
+#include <array>
 #include <system_error>
 
 // https://github.com/libp2p/interface-connection
 
 namespace p2p {
 
+    //
+    // write_stats counts the gather writes of a connection, each one draining several queued messages
+    //
+    struct write_stats {
+        uint64_t writes       = 0;  // number of gather writes (one writev each)
+        uint64_t messages     = 0;  // messages carried by those writes
+        uint64_t bytes        = 0;  // bytes carried by those writes
+        uint64_t max_messages = 0;  // most messages carried by a single write
+
+        // batches[i] counts the writes carrying between 2^i and 2^(i+1)-1 messages
+        std::array<uint64_t, 8> batches = {};
+    };
+
     class connection {
     public:
         /*
@@ -20,7 +35,49 @@ namespace p2p {
         // This method stores a reference to the peerInfo Object that contains information about the peer that this conn connects to.
         virtual void set_peerinfo(const peerinfo& info) = 0;
         */
+        using read_handler_t          = std::function<void(std::error_code, const multiformats::buffer_t&)>;
+        using borrowed_read_handler_t = std::function<void(std::error_code, const borrowed_buffer&)>;
+        using drain_handler_t         = std::function<void(std::error_code)>;
+        using send_file_handler_t     = std::function<void(std::error_code, size_t)>;
+
         virtual void write(const multiformats::buffer_t& msg) = 0;
-        virtual void read(const std::function<void(std::error_code, const multiformats::buffer_t&)>& handler) = 0;
+
+        // Write a pooled buffer (its size() bytes) without copying it
+        virtual void write(const shared_buffer& msg) = 0;
+
+        // Write unless the write queue is over its high watermark: false means "would block",
+        //   the message was not queued
+        virtual bool try_write(const shared_buffer& msg) = 0;
+
+        // Call the handler once the write queue drained under its low watermark (right away when it is)
+        virtual void await_drain(const drain_handler_t& handler) = 0;
+
+        // Bytes written but not sent yet, to throttle a producer
+        virtual size_t queued_bytes() const = 0;
+
+        // Send `length` bytes of the open file `fd` from `offset`, after the messages already written.
+        //   The handler gets the number of bytes handed to the connection; the file must stay open, and the
+        //   connection alive, until then. This version reads the file in chunks, away from the io threads,
+        //   and writes them; the TCP connections send it straight from the page cache where the system
+        //   can (sendfile), a bounded amount at a time.
+        virtual void send_file(int fd, uint64_t offset, size_t length, const send_file_handler_t& handler);
+
+        // Read the next available bytes, copied into a new buffer
+        virtual void read(const read_handler_t& handler) = 0;
+
+        // Read the next available bytes, lent to the handler straight from the pooled receive buffer
+        virtual void read(const borrowed_read_handler_t& handler) = 0;
+
+        // Close the connection, or abort it while it is still being established
+        virtual void close() = 0;
+
+        // False once the connection was closed, by close() or after an error
+        virtual bool is_open() const = 0;
+
+        // Run the task on the io thread of the connection, where its handlers run, after the current handler
+        virtual void post(std::function<void()> task) = 0;
+
+        // Counters of the writes issued so far
+        virtual write_stats stats() const { return {}; }
     };
 }
\ No newline at end of file
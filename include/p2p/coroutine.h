@@ -0,0 +1,287 @@
+#pragma once
+
+#include "connection.h"
+#include "utils/frame_allocator.h"
+
+// Coroutines of C++20, or of the Coroutines TS (MSVC /await, clang -fcoroutines-ts): the msvc test
+//   project builds coroutine-test.cpp with /await
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define P2P_HAS_COROUTINES 1
+namespace p2p { namespace coro = std; }
+#elif defined(__cpp_coroutines) || defined(_RESUMABLE_FUNCTIONS_SUPPORTED)
+// (MSVC /await only defines the latter)
+#include <experimental/coroutine>
+#define P2P_HAS_COROUTINES 1
+namespace p2p { namespace coro = std::experimental; }
+#endif
+
+#ifdef P2P_HAS_COROUTINES
+
+#include <exception>
+#include <memory>
+#include <utility>
+
+namespace p2p {
+
+    template <class T>
+    class task;
+
+    namespace details {
+
+        //
+        // The promise of a task: its frame comes from the frame_allocator, it starts suspended and
+        //   resumes the coroutine awaiting it once done. A detached task frees its own frame.
+        //
+        struct promise_base {
+            static void* operator new(size_t size)
+            {
+                return frame_allocator::allocate(size);
+            }
+
+            static void operator delete(void* frame, size_t size)
+            {
+                frame_allocator::deallocate(frame, size);
+            }
+
+            struct final_awaiter {
+                bool await_ready() noexcept { return false; }
+
+#ifdef __cpp_impl_coroutine
+                // symmetric transfer: the awaiting coroutine may destroy this frame as soon as it resumes
+                template <class Promise>
+                coro::coroutine_handle<> await_suspend(coro::coroutine_handle<Promise> handle) noexcept
+                {
+                    auto& promise = handle.promise();
+                    if (promise.continuation) return promise.continuation;
+                    if (promise.detached) handle.destroy();
+                    return coro::noop_coroutine();
+                }
+#else
+                template <class Promise>
+                void await_suspend(coro::coroutine_handle<Promise> handle) noexcept
+                {
+                    auto& promise = handle.promise();
+                    if (promise.continuation) return promise.continuation.resume();
+                    if (promise.detached) handle.destroy();
+                }
+#endif
+
+                void await_resume() noexcept { }
+            };
+
+            coro::suspend_always initial_suspend() noexcept { return {}; }
+            final_awaiter        final_suspend()   noexcept { return {}; }
+
+            // Like a thread, a detached task has nobody to report its exception to
+            void unhandled_exception()
+            {
+                if (detached) std::terminate();
+                error = std::current_exception();
+            }
+
+            void rethrow()
+            {
+                if (error) std::rethrow_exception(error);
+            }
+
+            coro::coroutine_handle<> continuation;
+            bool                     detached = false;
+            std::exception_ptr       error;
+        };
+
+        template <class T>
+        struct promise : promise_base {
+            void return_value(T result) { value = std::move(result); }
+
+            T result()
+            {
+                rethrow();
+                return std::move(value);
+            }
+
+            T value{};
+        };
+
+        template <>
+        struct promise<void> : promise_base {
+            void return_void() { }
+            void result() { rethrow(); }
+        };
+    }
+
+
+    //
+    // task is a coroutine started when it is awaited, or detached to run on its own.
+    //   co_await on a task resumes the awaiting coroutine with its result, once it completed.
+    //   The value of a task<T> must be default constructible.
+    //
+    template <class T = void>
+    class task {
+    public:
+        struct promise_type : details::promise<T> {
+            task get_return_object() { return task{ coro::coroutine_handle<promise_type>::from_promise(*this) }; }
+        };
+
+        task(task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) { }
+
+        task& operator=(task&& other) noexcept
+        {
+            std::swap(_handle, other._handle);
+            return *this;
+        }
+
+        ~task()
+        {
+            if (_handle) _handle.destroy();
+        }
+
+        // Run the task without awaiting it: its frame is freed when it completes
+        void detach()
+        {
+            auto handle = std::exchange(_handle, nullptr);
+            handle.promise().detached = true;
+            handle.resume();
+        }
+
+        struct awaiter {
+            coro::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept { return handle.done(); }
+
+#ifdef __cpp_impl_coroutine
+            coro::coroutine_handle<> await_suspend(coro::coroutine_handle<> continuation)
+            {
+                handle.promise().continuation = continuation;
+                return handle;
+            }
+#else
+            void await_suspend(coro::coroutine_handle<> continuation)
+            {
+                handle.promise().continuation = continuation;
+                handle.resume();
+            }
+#endif
+
+            T await_resume() { return handle.promise().result(); }
+        };
+
+        awaiter operator co_await() && { return { _handle }; }
+
+    private:
+        explicit task(coro::coroutine_handle<promise_type> handle) : _handle(handle) { }
+
+        coro::coroutine_handle<promise_type> _handle;
+    };
+
+
+    // The next bytes of a connection, lent until the coroutine suspends again: data.retain() keeps them
+    struct read_result {
+        std::error_code error;
+        borrowed_buffer data;
+    };
+
+    // The connection of a dial, null on error
+    struct dial_result {
+        std::error_code             error;
+        std::shared_ptr<connection> conn;
+    };
+
+    namespace details {
+
+        // The handlers only capture the awaiter and the coroutine: they fit in the small buffer of
+        //   std::function, awaiting allocates nothing but what the connection does
+        class read_awaiter {
+        public:
+            explicit read_awaiter(connection& conn) : _conn(conn) { }
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(coro::coroutine_handle<> handle)
+            {
+                _conn.read(connection::borrowed_read_handler_t{ [this, handle](std::error_code error, const borrowed_buffer& data) {
+                    _result.error = error;
+                    _result.data = data;
+                    handle.resume();
+                } });
+            }
+
+            read_result await_resume() { return _result; }
+
+        private:
+            connection& _conn;
+            read_result _result;
+        };
+
+        // A write only suspends when the connection is over its high watermark, until it drained
+        class write_awaiter {
+        public:
+            write_awaiter(connection& conn, const shared_buffer& msg) : _conn(conn), _msg(msg) { }
+
+            bool await_ready() { return _conn.try_write(_msg); }
+
+            void await_suspend(coro::coroutine_handle<> handle)
+            {
+                _conn.await_drain([this, handle](std::error_code error) {
+                    _error = error;
+                    if (!error) _conn.write(_msg);
+                    handle.resume();
+                });
+            }
+
+            std::error_code await_resume() { return _error; }
+
+        private:
+            connection&     _conn;
+            shared_buffer   _msg;
+            std::error_code _error;
+        };
+
+        template <class Dialer, class Target>
+        class dial_awaiter {
+        public:
+            dial_awaiter(Dialer& dialer, const Target& target) : _dialer(dialer), _target(target) { }
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(coro::coroutine_handle<> handle)
+            {
+                _dialer.dial(_target, [this, handle](const std::error_code& error, std::shared_ptr<connection> conn) {
+                    _result.error = error;
+                    _result.conn = std::move(conn);
+                    handle.resume();
+                });
+            }
+
+            dial_result await_resume() { return std::move(_result); }
+
+        private:
+            Dialer&     _dialer;
+            Target      _target;
+            dial_result _result;
+        };
+    }
+
+    // co_await async_read(conn): the coroutine resumes on the io thread of the connection
+    inline details::read_awaiter async_read(connection& conn)
+    {
+        return details::read_awaiter{ conn };
+    }
+
+    // co_await async_write(conn, msg): queue a message, waiting for the connection to drain when it
+    //   is over its high watermark
+    inline details::write_awaiter async_write(connection& conn, const shared_buffer& msg)
+    {
+        return details::write_awaiter{ conn, msg };
+    }
+
+    // co_await async_dial(node, peer) or async_dial(transport, multiaddr): any dialer taking a
+    //   handler (error, connection)
+    template <class Dialer, class Target>
+    details::dial_awaiter<Dialer, Target> async_dial(Dialer& dialer, const Target& target)
+    {
+        return details::dial_awaiter<Dialer, Target>{ dialer, target };
+    }
+}
+
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "connection.h"
+
+#include <memory>
+#include <vector>
+
+namespace p2p {
+
+    //
+    // Unsigned varints, as multiformats and the libp2p protocols use them: 7 bits per byte, the low
+    //   bits first, the high bit set on every byte but the last one.
+    //   The decoder tells an incomplete varint from a malformed one, to parse the bytes of a connection
+    //   as they come.
+    //
+    namespace uvarint {
+        const size_t max_size = 10;
+
+        // Write `value` to `out` (max_size bytes at most), return the number of bytes written
+        size_t encode(uint64_t value, byte* out);
+
+        // Parse the varint at the start of `size` bytes: the number of bytes it takes, 0 when they end
+        //   before it does, -1 when it does not fit in 64 bits
+        int decode(const byte* data, size_t size, uint64_t& value);
+    }
+
+
+    //
+    // framed_connection reads and writes the uvarint length-prefixed messages of a connection.
+    //   The frames are parsed straight from the receive buffer of the connection and lent to the read
+    //   handler, all the frames completed by a read at once. Only a frame split between two reads is
+    //   copied, into a buffer of the adapter.
+    //   It is driven from the io thread of its connection, like the connection reads.
+    //
+    class framed_connection : public std::enable_shared_from_this<framed_connection>
+    {
+    public:
+        // The frames, without their length prefix, lent until the handler returns: retain() keeps one
+        using frames_t       = std::vector<borrowed_buffer>;
+        using read_handler_t = std::function<void(std::error_code, const frames_t&)>;
+
+        // A frame longer than max_frame_size fails the read with message_size and closes the connection
+        framed_connection(std::shared_ptr<p2p::connection> conn, size_t max_frame_size = 1024 * 1024);
+
+        framed_connection(const framed_connection&) = delete;
+        framed_connection& operator=(const framed_connection&) = delete;
+
+        // Write a message with its length prefix, copied into a single pooled buffer
+        void write(multiformats::bufferview_t msg);
+
+        // Write a pooled message after its length prefix without copying it: two writes, sent
+        //   together by the gather write of the connection, the frames must be written from one thread
+        void write(const shared_buffer& msg);
+
+        // Read until at least one whole frame arrived, then call the handler with every whole frame received
+        void read(const read_handler_t& handler);
+
+        inline const std::shared_ptr<p2p::connection>& connection() const { return _conn; }
+        inline size_t max_frame_size() const { return _max_frame_size; }
+
+    private:
+        void on_read(const borrowed_buffer& data);
+        bool stage(const byte*& data, size_t& size);
+        void fail(std::error_code error);
+
+        std::shared_ptr<p2p::connection> _conn;
+        size_t                           _max_frame_size;
+        read_handler_t                   _handler;
+        frames_t                         _frames;
+
+        // the beginning of a frame split between two reads
+        shared_buffer                    _stage;
+    };
+
+}
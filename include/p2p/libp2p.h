@@ -1,8 +1,15 @@
 #pragma once
 
 
+#include "buffer.h"
 #include "connection.h"
+#include "coroutine.h"
 #include "crypto.h"
+#include "muxer.h"
 #include "node.h"
+#include "options.h"
 #include "peer.h"
-#include "transports/tcp.h"
\ No newline at end of file
+#include "secure_channel.h"
+#include "transports/memory.h"
+#include "transports/tcp.h"
+#include "transports/uring.h"
\ No newline at end of file
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "connection.h"
+#include "options.h"
+
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+namespace p2p {
+
+    class muxer_stream;
+
+    //
+    // muxer carries many streams over a single connection, framed as yamux frames
+    //   (https://github.com/hashicorp/yamux/blob/master/spec.md).
+    //   Each stream is a connection of its own. It has a flow control window: its writer gets ahead of
+    //   its reader by one window at most, so a slow stream does not hold back the others.
+    //   Closing a stream closes its writes only: it reads on until the peer closes its side too, or it is
+    //   reset once options::mux_t::half_close_timeout elapsed.
+    //   The frames of all the streams go to the write queue of the connection, which sends whatever
+    //   was queued meanwhile in a single gather write.
+    //   The muxer and its streams run their handlers on the io thread of the connection.
+    //
+    class muxer : public std::enable_shared_from_this<muxer>
+    {
+    public:
+        // The dialer of the connection opens the odd streams, the listener the even ones
+        enum class role_t { initiator, responder };
+
+        using stream_handler_t = std::function<void(std::shared_ptr<p2p::connection>)>;
+
+        muxer(std::shared_ptr<p2p::connection> conn, role_t role, const options& opts = options{});
+
+        muxer(const muxer&) = delete;
+        muxer& operator=(const muxer&) = delete;
+
+        // Read the frames of the connection: the handler gets the streams opened by the peer
+        void start(const stream_handler_t& handler);
+
+        // Open a stream, usable at once: its writes are sent after its opening
+        std::shared_ptr<p2p::connection> open();
+
+        // Tell the peer and close the connection: the streams fail with operation_aborted
+        void close();
+
+        // Number of streams open
+        inline size_t streams() const { return _count.load(std::memory_order_relaxed); }
+
+        inline const std::shared_ptr<p2p::connection>& connection() const { return _conn; }
+
+    private:
+        friend class muxer_stream;
+
+        struct frame_t {
+            uint8_t  version;
+            uint8_t  type;
+            uint16_t flags;
+            uint32_t stream;
+            uint32_t length;
+        };
+
+        // the rest run on the io thread of the connection
+        void read();
+        void on_read(const borrowed_buffer& data);
+        void on_frame(const frame_t& frame, const shared_buffer& payload);
+        void accept(const frame_t& frame, const shared_buffer& payload);
+        bool announce(muxer_stream& stream);
+        void send(uint8_t type, uint16_t flags, uint32_t stream, uint32_t length, const shared_buffer* payload = nullptr);
+        void flush(muxer_stream& stream);
+        void release(muxer_stream& stream);
+        void expire(muxer_stream& stream);
+        void shutdown(std::error_code error, uint32_t reason);
+
+        std::shared_ptr<p2p::connection> _conn;
+        role_t                           _role;
+        options                          _opts;
+        stream_handler_t                 _handler;
+
+        std::atomic<uint32_t>            _next_id;
+        std::atomic<size_t>              _count{ 0 };
+        std::unordered_map<uint32_t, std::shared_ptr<muxer_stream>> _streams;
+        size_t                           _inbound = 0;
+        bool                             _going_away = false;
+        bool                             _shut = false;
+
+        // the frame being received: its header, then the payload of a data frame
+        byte                             _header[12];
+        size_t                           _header_size = 0;
+        frame_t                          _frame;
+        shared_buffer                    _payload;
+        bool                             _in_payload = false;
+    };
+
+}
@@ -1,17 +1,22 @@
 #pragma once
 
+#include "options.h"
 #include "switch.h"
 #include <multiformats\multiaddr.h>
 #include <system_error>
 
 namespace p2p {
 
+    class io_pool;
+    namespace protocols { class ping; }
 
     class node {
         using modules_t = void*;
         
         using StartHandler = std::function<void(const std::error_code&, const multiformats::multiaddr&)>;
         using DialHandler = std::function<void(const std::error_code&, std::shared_ptr<connection>)>;
+        using CloseHandler = std::function<void(size_t)>;
+        using ProtocolHandler = std::function<void(std::shared_ptr<connection>)>;
 
     public:
     public:
@@ -19,10 +24,12 @@ namespace p2p {
         node(node&& n) = default;
 
         static node create(const peerinfo& info, const peerstore& store = peerstore{});
-        static node create(const modules_t& modules, const peerinfo& info, const peerstore& store);
+        static node create(const peerinfo& info, const options& opts, const peerstore& store = peerstore{});
+        static node create(const modules_t& modules, const peerinfo& info, const peerstore& store, const options& opts = options{});
 
         //
-        // Start the libp2p node by creating listeners on the multiaddrs the Peer wants to listen
+        // Start the libp2p node by creating listeners on the multiaddrs the Peer wants to listen: on its IP
+        //   addresses, a name is only advertised. Throws, with nothing left listening, when one cannot be bound.
         //
         void start();
 
@@ -31,28 +38,54 @@ namespace p2p {
         //
         void close();
 
+        //
+        // Stop the libp2p node gracefully: close its listeners, stop echoing, leave the open connections up
+        //   to `drain` to send their queued writes, then close them. The handler gets the number of bytes
+        //   that were still queued, lost, and runs on an io thread, even when the node is destroyed first.
+        //
+        void close(std::chrono::milliseconds drain, const CloseHandler& handler);
+
 
         void dial(const peerinfo& info, const DialHandler& handler);
         void dial(const peerid& info, const DialHandler& handler);
         void dial(const multiformats::multiaddr& info, const DialHandler& handler);
         
+        //
+        // Open a stream to the peer and negotiate the protocol on it (multistream-select): the streams
+        //   to a peer share its connection, multiplexed (see muxer.h). The multiplexer is negotiated
+        //   with the first stream, a peer without it fails with protocol_not_supported. The protocol of
+        //   the stream is selected lazily with options::negotiation_t::lazy: a refused one fails the
+        //   first read instead. An empty protocol gives the connection itself, as dial.
+        //
         void dialProtocol(const peerinfo& info, const std::string& protocol, const DialHandler& handler);
         void dialProtocol(const peerid& info, const std::string& protocol, const DialHandler& handler);
         void dialProtocol(const multiformats::multiaddr& info, const std::string& protocol, const DialHandler& handler);
 
+        //
+        // Handle the streams opened by the peers for the protocol, mounted on the switch. A node answers
+        //   /ipfs/ping/1.0.0 and /echo/1.0.0 (until replaced), and echoes the connections that do not
+        //   negotiate a protocol.
+        //
+        void handle(const protocol_t& protocol, const ProtocolHandler& handler);
+
         void hangup(const peerinfo& info);
         void hangup(const peerid& info);
         void hangup(const multiformats::multiaddr& info);
 
-        const bool  started() const { return false; }
+        bool        started() const { return _started; }
 
         const auto& info()    const { return _info; }
         const auto& store()   const { return _store; }
 
     private:
-        node(const modules_t& modules, const peerinfo& info, const peerstore& store);
+        node(const modules_t& modules, const peerinfo& info, const peerstore& store, const options& opts);
 
 
+    private:
+        // the continuous pings share the io threads of the node
+        friend class protocols::ping;
+        std::shared_ptr<io_pool> pool() const;
+
     private:
         peerinfo   _info;
         peerstore  _store;
@@ -60,12 +93,13 @@ namespace p2p {
         bool       _started;
 
         class nodeimpl;
-        std::unique_ptr<nodeimpl> _impl;
+        std::shared_ptr<nodeimpl> _impl;
     };
 
     enum class node_error
     {
         no_ipfs_address = 1,
+        no_dialable_address,
     };
 
     inline std::error_code make_error_code(node_error);
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace p2p {
+
+    //
+    // options gathers the runtime settings of a node, provided to node::create
+    //
+    struct options {
+
+        // io runtime: one event loop per thread
+        struct io_t {
+            // Number of io threads, 0 means one per hardware core
+            size_t threads = 0;
+
+            // Pin each io thread to its own core
+            bool   pin_threads = true;
+
+            // Resolution of the timeouts: the timers of each io thread share one wheel ticking at this pace,
+            //   see utils/timer_wheel.h
+            std::chrono::milliseconds timer_tick{ 10 };
+        };
+
+        // listeners
+        struct listen_t {
+            // Open one SO_REUSEPORT acceptor per io thread and let the kernel
+            //   spread the incoming connections (ignored where not supported)
+            bool   reuse_port = false;
+
+            // Number of accepts kept in flight by each acceptor
+            size_t pending_accepts = 4;
+
+            // Delay before an accept that failed is tried again, e.g. once the process ran out of file
+            //   descriptors (EMFILE): the listener keeps accepting until it is closed
+            std::chrono::milliseconds accept_retry{ 100 };
+        };
+
+        // TCP sockets, dialed and accepted: an option the system does not support is ignored
+        struct socket_t {
+            // TCP_NODELAY: send the small messages at once instead of coalescing them (Nagle)
+            bool no_delay = true;
+
+            // SO_SNDBUF and SO_RCVBUF in bytes, 0 keeps the system default and its autotuning
+            int  send_buffer    = 0;
+            int  receive_buffer = 0;
+
+            // TCP_QUICKACK (Linux): acknowledge at once instead of delaying the ACKs, set again after each read
+            bool quick_ack = false;
+
+            // SO_BUSY_POLL (Linux): microseconds spent polling the device queue for a receive, 0 disables it
+            int  busy_poll = 0;
+
+            // TCP_NOTSENT_LOWAT (Linux, macOS): most unsent bytes kept by the kernel, 0 keeps the default
+            int  notsent_lowat = 0;
+
+            // SO_KEEPALIVE, with the idle time, interval and count of the probes where they can be set
+            struct keepalive_t {
+                bool                 enabled = false;
+                std::chrono::seconds idle{ 60 };
+                std::chrono::seconds interval{ 10 };
+                int                  probes = 5;
+            } keepalive;
+        };
+
+        // outgoing connections: the addresses of a peer are raced, see utils/dial_order.h
+        struct dial_t {
+            enum class order_t {
+                published,       // the order of peerinfo::addrs()
+                ipv6_first,      // IPv6 and IPv4 interleaved, IPv6 first
+                ipv4_first,      // IPv4 and IPv6 interleaved, IPv4 first
+                loopback_first,  // loopback addresses, then the others
+            };
+
+            order_t order = order_t::ipv6_first;
+
+            // Try first the address of the last successful dial to the peer
+            bool last_good_first = true;
+
+            // Delay before the next attempt starts while the previous ones are still pending
+            //   (250 ms as recommended by RFC 8305); a failed attempt starts the next one at once
+            std::chrono::milliseconds stagger{ 250 };
+
+            // The names of the /dns4 and /dns6 addresses are resolved again after this delay
+            std::chrono::seconds resolve_ttl{ 60 };
+        };
+
+        // connection writes: the queued messages are drained together in one gather write
+        struct write_t {
+            // Most bytes gathered by a single write (a larger message is still written alone)
+            size_t max_gather_bytes = 256 * 1024;
+
+            // Most buffers gathered by a single write (bounded by IOV_MAX)
+            size_t max_gather_buffers = 64;
+
+            // Backpressure: try_write refuses new messages once this many bytes are queued,
+            //   await_drain resumes the producer when the queue fell back under the low watermark
+            size_t high_watermark = 4 * 1024 * 1024;
+            size_t low_watermark  = 1024 * 1024;
+        };
+
+        // connection reads: the receive buffer adapts to the traffic, see utils/adaptive_size.h.
+        //   A read that may wait for the peer, after one that emptied the socket, only holds min_buffer
+        struct read_t {
+            size_t min_buffer     = 1024;
+            size_t initial_buffer = 4 * 1024;
+            size_t max_buffer     = 256 * 1024;
+
+            // A read waiting longer than this for the peer means the connection went idle:
+            //   the buffer falls back to min_buffer
+            std::chrono::milliseconds idle_after{ 1000 };
+        };
+
+        // io_uring transport (Linux), see transports/uring.h
+        struct uring_t {
+            // Run the connections of the node on io_uring instead of asio (ignored where not supported)
+            bool     enabled = false;
+
+            // Submission queue entries of each ring
+            unsigned queue_depth = 4096;
+
+            // Provided receive buffers of each ring (a power of 2), and their size
+            unsigned buffers     = 1024;
+            size_t   buffer_size = 16 * 1024;
+        };
+
+        // timeouts of the TCP connections, 0 disables one
+        struct timeout_t {
+            // A dial that did not resolve and connect within this delay fails with timed_out
+            std::chrono::milliseconds dial{ 10000 };
+
+            // A read waiting longer than this for the peer closes the connection with timed_out
+            std::chrono::milliseconds read{ 0 };
+
+            // A connection nothing was read from or written to for this long is closed with timed_out
+            std::chrono::milliseconds idle{ 0 };
+        };
+
+        // stream multiplexing, see muxer.h
+        struct mux_t {
+            // Receive window of each stream: bytes the peer may send ahead of the reads, at least 256 KiB
+            uint32_t window = 256 * 1024;
+
+            // Streams opened by the peer kept at once, the next ones are reset
+            size_t   max_streams = 1024;
+
+            // A stream closed on this side reads on until the FIN of the peer: without it by then, it is reset
+            std::chrono::milliseconds half_close_timeout{ 30000 };
+        };
+
+        // protocol negotiation, see multiformats-ext/multistream.h
+        struct negotiation_t {
+            // The dialer sends its proposal with its first write instead of waiting for the listener to
+            //   accept it: one round trip less per stream opened, a refused protocol fails the first read
+            bool lazy = true;
+        };
+
+        // secure channel, see secure_channel.h
+        struct secure_t {
+            enum class cipher_t { aes_256_gcm, chacha20_poly1305 };
+
+            // The cipher proposed first by the dialer: the listener takes it unless it does not support it.
+            //   AES-GCM is the fastest with AES-NI and carry-less multiply, ChaCha20-Poly1305 without them
+            cipher_t cipher = cipher_t::aes_256_gcm;
+
+            // Most bytes of a record on the wire, its header and tag included: the writes made meanwhile
+            //   are sealed together, up to this size (a pooled block, at most 1 MiB)
+            size_t record_size = 64 * 1024;
+        };
+
+        // in-process transport, see transports/memory.h
+        struct memory_t {
+            // Messages each direction of a connection holds before the writes wait for the reader
+            size_t ring_size = 1024;
+        };
+
+        io_t          io;
+        listen_t      listen;
+        socket_t      socket;
+        dial_t        dial;
+        read_t        read;
+        write_t       write;
+        timeout_t     timeout;
+        uring_t       uring;
+        mux_t         mux;
+        negotiation_t negotiation;
+        secure_t      secure;
+        memory_t      memory;
+    };
+
+}
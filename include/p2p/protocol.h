@@ -1,7 +1,98 @@
 #pragma once
 
+#include <p2p/connection.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace p2p {
     using protocol_t = std::string;
-}
\ No newline at end of file
+
+    // A protocol interned by a protocol_table: the ids are dense, from 0, in the order of registration
+    using protocol_id = uint32_t;
+    const protocol_id no_protocol = UINT32_MAX;
+
+    //
+    // protocol_matcher is a pattern of protocols, parsed once:
+    //   "/ipfs/ping/1.0.0"  this protocol only
+    //   "/ipfs/ping/1.x"    the versions 1.*: 'x', 'X' or '*' stands for any number, the versions
+    //                       may have more numbers when the last one is a wildcard (1.x matches 1.2.3)
+    //   "/ipfs/*"           the protocols starting with "/ipfs/"
+    //
+    class protocol_matcher {
+    public:
+        enum class kind_t { exact, version, prefix };
+
+        explicit protocol_matcher(const protocol_t& pattern);
+
+        bool match(const protocol_t& protocol) const;
+
+        inline kind_t            kind()    const { return _kind; }
+        inline const protocol_t& pattern() const { return _pattern; }
+
+        // The longer the fixed part, the more specific the pattern
+        inline size_t specificity() const { return _specificity; }
+
+    private:
+        kind_t                   _kind;
+        protocol_t               _pattern;
+        protocol_t               _prefix;    // the pattern up to its version or its '*'
+        std::vector<std::string> _version;   // the numbers of the version, empty for a wildcard
+        size_t                   _specificity;
+    };
+
+    //
+    // protocol_table routes the protocols to their handlers. The exact protocols are interned in a flat
+    //   hash table (open addressing, linear probing, at most half full): a lookup hashes the name once and
+    //   compares a slot or two, whatever the number of protocols. The patterns are tried next, the most
+    //   specific first. The ids stay valid once interned, removing a protocol only drops its handler.
+    //   Thread-safe: the handlers run outside of the lock.
+    //
+    class protocol_table {
+    public:
+        using handler_t = std::function<void(std::shared_ptr<connection>, const protocol_t&)>;
+
+        // Handle a protocol, or the protocols matching a pattern, instead of the previous handler
+        protocol_id add(const protocol_t& pattern, const handler_t& handler);
+        void remove(const protocol_t& pattern);
+
+        // The id of the protocol, or of the pattern matching it: no_protocol when none is handled
+        protocol_id find(const protocol_t& protocol) const;
+        bool route(const protocol_t& protocol, handler_t& handler) const;
+
+        // Give the connection to the handler of its protocol: false when none handles it
+        bool dispatch(std::shared_ptr<connection> conn, const protocol_t& protocol) const;
+
+        // The protocols and patterns handled, in the order of registration
+        std::vector<protocol_t> protocols() const;
+        size_t size() const;
+
+    private:
+        struct entry_t {
+            protocol_matcher matcher;
+            handler_t        handler;
+        };
+
+        struct slot_t {
+            uint32_t    hash = 0;
+            protocol_id id = no_protocol;   // empty slot
+        };
+
+        static uint32_t hash(const protocol_t& protocol);
+
+        protocol_id match(const protocol_t& protocol) const;
+        protocol_id lookup(const protocol_t& protocol) const;
+        protocol_id intern(const protocol_t& pattern);
+        void        rehash(size_t capacity);
+
+        mutable std::mutex       _mutex;
+        std::vector<entry_t>     _entries;    // by id
+        std::vector<slot_t>      _slots;      // the exact protocols, a power of 2
+        std::vector<protocol_id> _patterns;   // the most specific first
+        size_t                   _handled = 0;
+    };
+}
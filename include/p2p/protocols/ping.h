@@ -2,23 +2,84 @@
 
 #include <p2p/switch.h>
 #include <p2p/protocol.h>
+#include <p2p/options.h>
+#include <p2p/utils/rtt_histogram.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <vector>
 
 
 namespace p2p {
+
+    class io_pool;
+    class node;
+
 namespace protocols {
 
+    //
+    // ping measures the round trips to the peers (/ipfs/ping/1.0.0): the dialer sends 32 random bytes on
+    //   a stream for the protocol, the listener sends them back, and again on the same stream.
+    //   In continuous mode, a ping instance pings its peers at an interval and keeps the RTTs of each one in
+    //   a histogram (see utils/rtt_histogram.h): for the health checks, and to rank the peers to dial.
+    //   Its timers run on the io threads of a node, in their timer wheels.
+    //
     class ping
     {
     public:
-        const protocol_t Protocol = "/ipfs/ping/1.0.0";
+        using rtt_t         = rtt_histogram::duration;
+        using handler_t     = std::function<void(const std::error_code&, rtt_t)>;
+        using end_handler_t = std::function<void(const std::error_code&)>;
 
-        static inline void mount(switchhub* p_switch) {
-            p_switch->handle(Protocol,  )
-        }
+        static const protocol_t Protocol;
+        static const size_t     payload_size = 32;
 
-        void unmount(switchhub* p_switch);
-    };
+        // Answer the pings of the peers
+        static void mount(switchhub* p_switch);
+        static void unmount(switchhub* p_switch);
+
+        // Send the pings back until the stream closes
+        static void answer(std::shared_ptr<connection> stream);
+
+        // Measure one round trip on a stream for the protocol: a payload that does not come back intact
+        //   fails with protocol_error. The handler runs on the io thread of the stream.
+        static void once(std::shared_ptr<connection> stream, const handler_t& handler);
+
+    public:
+        // The timers of the continuous mode run on the io threads of the node, shared with it. A ping not
+        //   back within the timeout fails with timed_out.
+        explicit ping(node& n, std::chrono::milliseconds timeout = std::chrono::milliseconds{ 10000 });
+        ~ping();
+
+        ping(const ping&) = delete;
+        ping& operator=(const ping&) = delete;
 
+        // Ping a peer every interval on a stream for the protocol, until it fails or stop(): a new stream
+        //   replaces the one of the peer. The RTTs add up in the histogram of the peer, a ping that fails
+        //   or times out counts as a failure, closes the stream and stops the pings: the handler gets the error.
+        void start(const peerid& peer, std::shared_ptr<connection> stream, std::chrono::milliseconds interval, const end_handler_t& handler = {});
 
+        // Same, on a stream opened by the node: a failed dial counts as a failure too
+        void start(node& n, const peerinfo& peer, std::chrono::milliseconds interval, const end_handler_t& handler = {});
+
+        // Stop pinging a peer: its histogram stays
+        void stop(const peerid& peer);
+
+        // The RTTs of a peer so far, p50(), p99() and max(): empty for a peer never pinged
+        rtt_histogram rtts(const peerid& peer) const;
+
+        // The pings of a peer that failed or timed out, and its failed dials
+        size_t failures(const peerid& peer) const;
+
+        // The peers pinged, the lowest median RTT first
+        std::vector<peerid> ranking() const;
+
+    private:
+        class pingimpl;
+        std::shared_ptr<pingimpl> _impl;
+    };
+
+}
 }
-}
\ No newline at end of file
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "connection.h"
+#include "options.h"
+#include "protocol.h"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace p2p {
+
+    //
+    // secure_channel authenticates the peer of a connection and encrypts what goes through it, as secio
+    //   does (it is not wire compatible with it):
+    //   - handshake: each side sends an ephemeral X25519 key, the ciphers it supports and its RSA public
+    //     key, then signs both hellos with its RSA private key (PSS, SHA-256). The keys of each direction
+    //     are derived from the X25519 secret with HKDF-SHA256 over the hellos.
+    //   - records: [4 bytes length][ciphertext][16 bytes tag], sealed with AES-256-GCM or
+    //     ChaCha20-Poly1305, the nonce counting the records of the direction.
+    //   The writes are copied into the open record, sealed in place once it is full or at the end of
+    //   the io task that wrote them, and sent in order by the io thread: a record carries many small writes, a large write
+    //   spans several records. The records received are opened in place in pooled buffers, lent to the
+    //   reads like the bytes of a connection.
+    //   The channel is a connection of its own, its handlers run on the io thread of the connection.
+    //
+    class secure_channel : public connection, public std::enable_shared_from_this<secure_channel>
+    {
+    public:
+        using cipher_t  = options::secure_t::cipher_t;
+        using handler_t = std::function<void(std::error_code, std::shared_ptr<secure_channel>)>;
+
+        static const protocol_t Protocol;
+
+        // Secure a dialed connection: the handshake fails with permission_denied unless the peer
+        //   proves it owns the key of `remote`
+        static void dial(std::shared_ptr<connection> conn, const peerid& local, const peerid& remote, const options& opts, const handler_t& handler);
+
+        // Secure an accepted connection, for any peer: remote() tells which one
+        static void accept(std::shared_ptr<connection> conn, const peerid& local, const options& opts, const handler_t& handler);
+
+        ~secure_channel();
+
+        secure_channel(const secure_channel&) = delete;
+        secure_channel& operator=(const secure_channel&) = delete;
+
+        // The authenticated peer, and the cipher negotiated
+        inline const peerid& remote() const { return *_remote; }
+        inline cipher_t      cipher() const { return _cipher; }
+
+        // connection interface
+        void write(const multiformats::buffer_t& msg);
+        void write(const shared_buffer& msg);
+        bool try_write(const shared_buffer& msg);
+        void await_drain(const drain_handler_t& handler);
+        size_t queued_bytes() const;
+        void read(const read_handler_t& handler);
+        void read(const borrowed_read_handler_t& handler);
+        void close();
+        bool is_open() const;
+        void post(std::function<void()> task);
+        write_stats stats() const;
+
+        inline const std::shared_ptr<p2p::connection>& connection() const { return _conn; }
+
+    private:
+        enum class role_t { initiator, responder };
+
+        struct cipher_state;
+        struct handshake_state;
+
+        secure_channel(std::shared_ptr<p2p::connection> conn, role_t role, const peerid& local, const options& opts);
+
+        void start(const handler_t& handler);
+
+        // the handshake and the reads run on the io thread of the connection
+        void pull();
+        void on_read(const borrowed_buffer& data);
+        void on_record(shared_buffer& record);
+        void on_hello(const shared_buffer& hello);
+        void on_proof(const shared_buffer& proof);
+        void established();
+        void deliver();
+        void fail(std::error_code error);
+
+        // the writes may come from any thread
+        void append(const byte* data, size_t size);
+        void seal();
+        void flush();
+        void send_plain(const multiformats::buffer_t& msg);
+
+        std::shared_ptr<p2p::connection> _conn;
+        role_t                           _role;
+        options                          _opts;
+        size_t                           _record_size;
+        cipher_t                         _cipher;
+        std::unique_ptr<peerid>          _local;
+        std::unique_ptr<peerid>          _remote;
+        std::unique_ptr<handshake_state> _handshake;
+        handler_t                        _handler;
+
+        std::atomic<bool>                _closed{ false };
+
+        // writes: the open record, [header][plaintext so far], and the records sealed since the last
+        //   flush. The writers seal them under the mutex, the io thread sends them.
+        std::mutex                       _write_mutex;
+        std::unique_ptr<cipher_state>    _seal;
+        shared_buffer                    _record;
+        std::vector<shared_buffer>       _sealed;
+        std::atomic<size_t>              _unsent{ 0 };
+        bool                             _flush_posted = false;
+        bool                             _write_closed = false;
+
+        // reads: the record being received, its header then its body, and the records opened
+        std::unique_ptr<cipher_state>    _open;
+        byte                             _header[4];
+        size_t                           _header_size = 0;
+        shared_buffer                    _in;
+        size_t                           _in_length = 0;
+        bool                             _in_body = false;
+        std::deque<shared_buffer>        _inbox;
+        borrowed_read_handler_t          _reading;
+        bool                             _pulling = false;
+        std::error_code                  _error;
+    };
+
+}
@@ -9,17 +9,25 @@
 namespace p2p {
 
     class switchhub {
-        //using handlerfunc_t = std::function<>
+    public:
+        using handler_t = protocol_table::handler_t;
+
     public:
         switchhub(const peerinfo& info, const peerstore& store) :
-            _info(info), _store(store) {};
+            _info(info), _store(store), _protocols(std::make_shared<protocol_table>()) {};
 
         // Start listening on all available transports
         void start();
 
         void stop();
 
-        //void handle(protocol_t protocol, )
+        // protocols: exact ones, semver ranges ("/ipfs/ping/1.x") or prefixes ("/ipfs/*"), see protocol.h
+        protocol_id handle(const protocol_t& protocol, const handler_t& handler);
+        void unhandle(const protocol_t& protocol);
+
+        // Route an inbound stream to the handler of its protocol: false when none handles it
+        bool dispatch(std::shared_ptr<connection> conn, const protocol_t& protocol) const;
+        inline const std::shared_ptr<protocol_table>& protocols() const { return _protocols; }
 
         // transport
         void add(sp_transport transport);
@@ -32,6 +40,7 @@ namespace p2p {
         peerinfo  _info;
         peerstore _store;
         std::map<transport::id_t, sp_transport> _transports;
+        std::shared_ptr<protocol_table>         _protocols;
     };
 
     //using sp_switch = std::shared_ptr<switchhub>;
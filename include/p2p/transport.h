@@ -8,28 +8,37 @@ namespace p2p {
 
     class listener {
     public:
-        using handler_t = std::function<void(const connection&)>;
+        using handler_t = std::function<void(std::shared_ptr<connection>)>;
 
-        // This method creates a listener on the transport.
-        static listener create(handler_t handler)
-        {
-            return {};
-        }
+        virtual ~listener() = default;
+
+        // This method starts accepting connections on the multiaddr, and returns the address actually
+        //   bound (e.g. with the port picked by the system when port 0 was requested).
+        virtual multiformats::multiaddr listen(const multiformats::multiaddr& ma) = 0;
 
+        // This method stops accepting new connections.
+        virtual void close() = 0;
     };
 
+    using sp_listener = std::shared_ptr<listener>;
+
     class transport {
     public:
         using id_t = std::string;
+        using dial_handler_t = std::function<void(const std::error_code&, std::shared_ptr<connection>)>;
 
     public:
+        virtual ~transport() = default;
+
         virtual id_t id() const = 0;
 
         // This method dials a transport to the Peer listening on multiaddr.
-        virtual std::unique_ptr<connection> dial(const multiformats::multiaddr&) = 0;
+        //   The handler is called on the io thread of the new connection. The connection being
+        //   established is returned at once: closing it cancels the dial.
+        virtual std::shared_ptr<connection> dial(const multiformats::multiaddr& ma, const dial_handler_t& handler) = 0;
 
-        // This method creates a listener on the transport.
-        virtual listener create_listener(std::function<void(const connection&)> handler) = 0;
+        // This method creates a listener on the transport; the handler receives each accepted connection.
+        virtual sp_listener create_listener(const listener::handler_t& handler) = 0;
 
 
         virtual bool match(const multiformats::multiaddr& addr) const = 0;
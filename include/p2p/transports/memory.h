@@ -0,0 +1,42 @@
+#pragma once
+
+#include <p2p/connection.h>
+#include <p2p/options.h>
+#include <p2p/transport.h>
+
+namespace p2p {
+
+    class io_pool;
+
+namespace transports {
+
+    //
+    // memory connects the peers of the same process on /memory/<name> multiaddrs, without any socket.
+    //   The two ends of a connection exchange the handles of the pooled buffers written through a pair
+    //   of lock-free single-producer single-consumer rings: a message is never copied, and a read or a
+    //   write only wakes the io thread of the other end when it is waiting.
+    //   The names are shared by all the memory transports of the process.
+    //
+    class memory : public transport
+    {
+    public:
+        // Create a standalone transport, running its own io threads
+        explicit memory(const options& opts = options{});
+
+        // Create the transport of a node, sharing its io threads
+        memory(const std::shared_ptr<io_pool>& pool, const options& opts);
+
+        virtual inline id_t id() const { return "memory"; }
+
+        // transport interface
+        virtual std::shared_ptr<connection> dial(const multiformats::multiaddr& ma, const dial_handler_t& handler);
+        virtual sp_listener create_listener(const listener::handler_t& handler);
+
+        virtual bool match(const multiformats::multiaddr& addr) const;
+
+    private:
+        std::shared_ptr<io_pool> _pool;
+        options                  _opts;
+    };
+
+}}
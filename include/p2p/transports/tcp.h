@@ -1,21 +1,51 @@
 #pragma once
 
 #include <p2p/connection.h>
+#include <p2p/options.h>
 #include <p2p/transport.h>
 
 namespace p2p {
+
+    class io_pool;
+    class dns_cache;
+
 namespace transports {
 
+    // Counters of the name resolution cache of the tcp transport
+    struct resolve_stats {
+        uint64_t hits      = 0;  // lookups answered from the cache
+        uint64_t misses    = 0;  // lookups sent to the system resolver
+        uint64_t coalesced = 0;  // lookups that joined a query already in flight
+    };
+
+    //
+    // tcp dials and listens on /ip4, /ip6, /dns4 and /dns6 multiaddrs.
+    //   Literal addresses are connected to without any lookup, the names are resolved through a cache.
+    //
     class tcp : public transport
     {
     public:
+        // Create a standalone transport, running its own io threads
+        explicit tcp(const options& opts = options{});
+
+        // Create the transport of a node, sharing its io threads
+        tcp(const std::shared_ptr<io_pool>& pool, const options& opts);
+
         virtual inline id_t id() const { return "TCP"; }
 
         // transport interface
-        virtual std::unique_ptr<connection> dial(const multiformats::multiaddr& ma);
-        virtual listener create_listener(std::function<void(const connection&)> handler);
+        virtual std::shared_ptr<connection> dial(const multiformats::multiaddr& ma, const dial_handler_t& handler);
+        virtual sp_listener create_listener(const listener::handler_t& handler);
 
         virtual bool match(const multiformats::multiaddr& addr) const;
+
+        // Counters of the /dns4 and /dns6 lookups
+        resolve_stats dns_stats() const;
+
+    private:
+        std::shared_ptr<io_pool>   _pool;
+        options                    _opts;
+        std::shared_ptr<dns_cache> _dns;
     };
 
 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <p2p/connection.h>
+#include <p2p/options.h>
+#include <p2p/transport.h>
+
+// The io_uring transport needs Linux 6.0 or later and liburing 2.4 or later
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<liburing.h>)
+#define P2P_HAS_IO_URING 1
+#endif
+#endif
+
+#ifdef P2P_HAS_IO_URING
+
+namespace p2p {
+namespace transports {
+
+    class uring_runtime;
+
+    //
+    // uring is a TCP transport driven by io_uring instead of asio: each of its threads owns a ring.
+    //   - listeners keep a multishot accept on their ring,
+    //   - connections receive into a ring of provided buffers, lent to the read handlers,
+    //   - the queued messages of a connection are sent as one chain of linked sends.
+    //   Only the literal /ip4 and /ip6 addresses are supported, there is no name resolution.
+    //   The connections and listeners keep the rings running, as the asio ones keep their io_pool.
+    //
+    class uring : public transport
+    {
+    public:
+        // Start the rings, one per io thread (options::io.threads); throws std::system_error when
+        //   the kernel does not support the features used
+        explicit uring(const options& opts = options{});
+        ~uring();
+
+        virtual inline id_t id() const { return "TCP/io_uring"; }
+
+        // transport interface
+        virtual std::shared_ptr<connection> dial(const multiformats::multiaddr& ma, const dial_handler_t& handler);
+        virtual sp_listener create_listener(const listener::handler_t& handler);
+
+        virtual bool match(const multiformats::multiaddr& addr) const;
+
+    private:
+        std::shared_ptr<uring_runtime> _runtime;
+        options                        _opts;
+    };
+
+}}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+namespace p2p {
+
+    //
+    // adaptive_size picks the size of the next receive buffer of a connection, within [min, max]:
+    //   - it doubles when a read filled the whole buffer,
+    //   - it halves after two reads in a row that used at most half of it,
+    //   - it drops to the minimum when the read waited for the peer long enough to call the connection idle.
+    //
+    class adaptive_size
+    {
+    public:
+        adaptive_size(size_t min, size_t initial, size_t max)
+            : _min((std::max)(min, size_t{ 1 }))
+            , _max((std::max)(_min, max))
+            , _size((std::min)((std::max)(initial, _min), _max))
+            , _shrink(false)
+        {}
+
+        inline size_t next() const { return _size; }
+        inline size_t min()  const { return _min; }
+
+        void record(size_t bytes_read, bool idle = false)
+        {
+            if (idle) {
+                _size = _min;
+                _shrink = false;
+            }
+            else if (bytes_read >= _size) {
+                _size = (std::min)(_size * 2, _max);
+                _shrink = false;
+            }
+            else if (bytes_read <= _size / 2 && _size > _min) {
+                if (_shrink) _size = (std::max)(_size / 2, _min);
+                _shrink = !_shrink;
+            }
+            else {
+                _shrink = false;
+            }
+        }
+
+    private:
+        size_t _min;
+        size_t _max;
+        size_t _size;
+        bool   _shrink;
+    };
+
+}
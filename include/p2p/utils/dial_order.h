@@ -0,0 +1,64 @@
+#pragma once
+
+#include <p2p/options.h>
+#include <multiformats/multiaddr.h>
+#include <algorithm>
+#include <vector>
+
+namespace p2p {
+
+    //
+    // order_addresses sorts the addresses of a peer in the order they are dialed:
+    //   - the address of the last successful dial comes first, when it is still published,
+    //   - the others follow the order of the options; with a family first, IPv6 and IPv4 are
+    //     interleaved so that a broken family only delays the other one by a stagger.
+    //
+    template <class MultiaddrContainer>
+    std::vector<multiformats::multiaddr> order_addresses(const MultiaddrContainer& addresses, const options::dial_t& opts, const multiformats::multiaddr* last_good = nullptr)
+    {
+        using multiformats::multiaddr;
+        using order_t = options::dial_t::order_t;
+
+        auto is_ip6 = [](multiaddr ma) { return ma[0].addr() == multiformats::ip6; };
+        auto is_loopback = [is_ip6](multiaddr ma) {
+            auto host = ma[0].str();
+            return is_ip6(ma) ? host == "::1" : host.compare(0, 4, "127.") == 0;
+        };
+
+        auto result = std::vector<multiaddr>{ std::begin(addresses), std::end(addresses) };
+
+        switch (opts.order)
+        {
+        case order_t::ipv6_first:
+        case order_t::ipv4_first:
+        {
+            auto first = std::vector<multiaddr>{};
+            auto second = std::vector<multiaddr>{};
+            for (auto& ma : result)
+                (is_ip6(ma) == (opts.order == order_t::ipv6_first) ? first : second).push_back(ma);
+
+            result.clear();
+            for (auto i = size_t{ 0 }; i < (std::max)(first.size(), second.size()); i++) {
+                if (i < first.size())  result.push_back(first[i]);
+                if (i < second.size()) result.push_back(second[i]);
+            }
+            break;
+        }
+
+        case order_t::loopback_first:
+            std::stable_partition(result.begin(), result.end(), is_loopback);
+            break;
+
+        case order_t::published:
+            break;
+        }
+
+        if (last_good && opts.last_good_first) {
+            auto it = std::find(result.begin(), result.end(), *last_good);
+            if (it != result.end()) std::rotate(result.begin(), it, it + 1);
+        }
+
+        return result;
+    }
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <new>
+
+namespace p2p {
+
+    //
+    // frame_allocator recycles the frames of the coroutines. Every thread keeps the frames it frees
+    //   in free lists, one per size class of 64 bytes up to 1 KiB, so that a coroutine started again and
+    //   again on an io thread reuses the same few frames. A frame released by another thread than the one
+    //   that allocated it joins the cache of the releasing thread. Larger frames go straight to the heap.
+    //
+    class frame_allocator {
+    public:
+        static const size_t granularity  = 64;
+        static const size_t size_classes = 16;
+
+        // Frames kept by each thread in each class, the others go back to the heap
+        static const size_t max_cached = 64;
+
+        static void* allocate(size_t size)
+        {
+            auto index = size_class(size);
+            if (index >= size_classes) return ::operator new(size);
+
+            auto& list = cache().lists[index];
+            if (!list.head) return ::operator new(class_size(index));
+
+            auto frame = list.head;
+            list.head = frame->next;
+            list.count--;
+            return frame;
+        }
+
+        static void deallocate(void* p, size_t size) noexcept
+        {
+            auto index = size_class(size);
+            if (index >= size_classes) return ::operator delete(p);
+
+            auto& list = cache().lists[index];
+            if (list.count >= max_cached) return ::operator delete(p);
+
+            auto frame = static_cast<free_frame*>(p);
+            frame->next = list.head;
+            list.head = frame;
+            list.count++;
+        }
+
+    private:
+        struct free_frame {
+            free_frame* next;
+        };
+
+        struct free_list {
+            free_frame* head = nullptr;
+            size_t      count = 0;
+        };
+
+        struct thread_cache {
+            std::array<free_list, size_classes> lists;
+
+            ~thread_cache()
+            {
+                for (auto& list : lists) {
+                    while (list.head) {
+                        auto frame = list.head;
+                        list.head = frame->next;
+                        ::operator delete(frame);
+                    }
+                }
+            }
+        };
+
+        static thread_cache& cache()
+        {
+            static thread_local thread_cache cache;
+            return cache;
+        }
+
+        static size_t size_class(size_t size) { return size ? (size - 1) / granularity : 0; }
+        static size_t class_size(size_t index) { return (index + 1) * granularity; }
+    };
+
+}
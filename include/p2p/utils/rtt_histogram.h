@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace p2p {
+
+    //
+    // rtt_histogram counts round-trip times in log-linear buckets, as an HDR histogram: exact up to 64 us,
+    //   then 32 buckets per power of 2, a relative error under 3% up to 71 minutes (2^32 us, the longer
+    //   times are clamped). Recording is O(1), a percentile scans the 896 counters, without any allocation.
+    //   Not thread-safe.
+    //
+    class rtt_histogram {
+    public:
+        using duration = std::chrono::microseconds;
+
+        void record(duration rtt)
+        {
+            auto value = static_cast<uint64_t>((std::max)(rtt.count(), duration::rep{ 0 }));
+            if (value > max_value) value = max_value;
+
+            _counts[index(value)]++;
+            _min = _total ? (std::min)(_min, value) : value;
+            _max = (std::max)(_max, value);
+            _sum += value;
+            _total++;
+        }
+
+        // The time under which `percent` of the RTTs are, rounded up to its bucket: zero when empty
+        duration percentile(double percent) const
+        {
+            if (!_total) return duration{ 0 };
+
+            auto rank = static_cast<uint64_t>(percent / 100 * _total + 0.5);
+            rank = (std::max)(rank, uint64_t{ 1 });
+
+            auto seen = uint64_t{ 0 };
+            for (auto i = size_t{ 0 }; i < _counts.size(); i++) {
+                seen += _counts[i];
+                if (seen >= rank) return duration{ static_cast<duration::rep>((std::min)(highest(i), _max)) };
+            }
+            return max();
+        }
+
+        inline duration p50() const { return percentile(50); }
+        inline duration p99() const { return percentile(99); }
+        inline duration min() const { return duration{ static_cast<duration::rep>(_min) }; }
+        inline duration max() const { return duration{ static_cast<duration::rep>(_max) }; }
+
+        inline duration mean() const
+        {
+            return duration{ static_cast<duration::rep>(_total ? _sum / _total : 0) };
+        }
+
+        inline uint64_t count() const { return _total; }
+        inline bool     empty() const { return _total == 0; }
+
+        void reset()
+        {
+            *this = rtt_histogram{};
+        }
+
+    private:
+        static const unsigned sub_bits  = 5;                 // 32 buckets per power of 2
+        static const uint64_t sub_count = 1 << sub_bits;
+        static const uint64_t max_value = 0xffffffff;
+
+        // The values under 2 * sub_count have a bucket each; above, a bucket spans 2^shift values
+        static size_t index(uint64_t value)
+        {
+            if (value < 2 * sub_count) return static_cast<size_t>(value);
+
+            auto shift = unsigned{ 0 };
+            while ((value >> shift) >= 2 * sub_count) shift++;
+            return static_cast<size_t>(shift * sub_count + (value >> shift));
+        }
+
+        // The highest value of a bucket
+        static uint64_t highest(size_t index)
+        {
+            if (index < 2 * sub_count) return index;
+
+            auto shift = static_cast<unsigned>(index / sub_count - 1);
+            auto top = index - shift * sub_count;
+            return ((top + 1) << shift) - 1;
+        }
+
+        std::array<uint32_t, (32 - sub_bits - 1) * sub_count + 2 * sub_count> _counts{};
+        uint64_t _total = 0;
+        uint64_t _sum   = 0;
+        uint64_t _min   = 0;
+        uint64_t _max   = 0;
+    };
+}
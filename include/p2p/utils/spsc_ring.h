@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace p2p {
+
+    //
+    // spsc_ring is a bounded lock-free queue between one producer thread and one consumer thread.
+    //   The capacity is rounded up to a power of 2. Each side keeps its own copy of the other
+    //   side's index, and only reloads it when the ring looks full (or empty): in the common case
+    //   a push or a pop touches no cache line written by the other thread.
+    //
+    template <class T>
+    class spsc_ring {
+    public:
+        explicit spsc_ring(size_t capacity)
+            : _slots(round_up(capacity)), _mask(_slots.size() - 1)
+        { }
+
+        spsc_ring(const spsc_ring&) = delete;
+        spsc_ring& operator=(const spsc_ring&) = delete;
+
+        inline size_t capacity() const { return _slots.size(); }
+
+        // Number of values in the ring, exact only from the producer or the consumer thread
+        inline size_t size() const
+        {
+            return _tail.value.load(std::memory_order_acquire) - _head.value.load(std::memory_order_acquire);
+        }
+
+        inline bool empty() const { return size() == 0; }
+
+        // Producer: false when the ring is full, the value was not moved then
+        bool push(T&& value)
+        {
+            auto tail = _tail.value.load(std::memory_order_relaxed);
+            if (tail - _tail.cached == _slots.size()) {
+                _tail.cached = _head.value.load(std::memory_order_acquire);
+                if (tail - _tail.cached == _slots.size()) return false;
+            }
+
+            _slots[tail & _mask] = std::move(value);
+            _tail.value.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool push(const T& value)
+        {
+            auto copy = value;
+            return push(std::move(copy));
+        }
+
+        // Consumer: false when the ring is empty
+        bool pop(T& value)
+        {
+            auto head = _head.value.load(std::memory_order_relaxed);
+            if (head == _head.cached) {
+                _head.cached = _tail.value.load(std::memory_order_acquire);
+                if (head == _head.cached) return false;
+            }
+
+            // leave an empty value behind: the slot must not keep a resource alive
+            value = std::move(_slots[head & _mask]);
+            _slots[head & _mask] = T{};
+            _head.value.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        static const size_t cache_line = 64;
+
+        static size_t round_up(size_t capacity)
+        {
+            auto size = size_t{ 1 };
+            while (size < capacity) size <<= 1;
+            return size;
+        }
+
+        // An index written by one side, with that side's copy of the other index, alone on its cache line
+        struct index_t {
+            std::atomic<size_t> value{ 0 };
+            size_t              cached = 0;
+            char                padding[cache_line - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+        };
+
+        std::vector<T> _slots;
+        size_t         _mask;
+        char           _padding[cache_line];   // read by both sides, never written
+
+        index_t _head;   // next value to pop, written by the consumer
+        index_t _tail;   // next slot to fill, written by the producer
+    };
+
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+namespace p2p {
+
+    //
+    // timer_wheel keeps the timers of one thread: arming, re-arming and cancelling a timer is O(1),
+    //   without any allocation, whatever the number of timers.
+    //   The time advances by ticks. Level 0 has one slot per tick for the next 256 ticks, each level above
+    //   has 256 slots covering 256 times the span of the level below; when the time reaches a slot of an
+    //   upper level, its timers are spread over the level below (the cascade). Beyond the 4 levels
+    //   (2^32 ticks, 497 days with 10 ms ticks) the deadlines are clamped.
+    //   The timers are intrusive: the wheel links them, their owner keeps them alive while they are armed.
+    //
+    class timer_wheel {
+    public:
+        using clock      = std::chrono::steady_clock;
+        using duration   = clock::duration;
+        using callback_t = std::function<void()>;
+
+        class timer {
+        public:
+            timer() = default;
+            explicit timer(callback_t callback) : _callback(std::move(callback)) { }
+            timer(const timer&) = delete;
+            timer& operator=(const timer&) = delete;
+
+            inline bool armed() const { return _pprev != nullptr; }
+
+        private:
+            friend class timer_wheel;
+
+            timer**    _pprev = nullptr;   // the pointer to this timer in its slot list, null when not armed
+            timer*     _next = nullptr;
+            uint64_t   _expiry = 0;        // tick
+            callback_t _callback;
+        };
+
+        explicit timer_wheel(duration tick, clock::time_point start = clock::now())
+            : _tick(tick.count() > 0 ? tick : duration{ 1 }), _start(start)
+        {
+            for (auto& level : _slots) level.fill(nullptr);
+        }
+
+        timer_wheel(const timer_wheel&) = delete;
+        timer_wheel& operator=(const timer_wheel&) = delete;
+
+        inline duration tick()  const { return _tick; }
+        inline size_t   size()  const { return _size; }
+        inline bool     empty() const { return _size == 0; }
+
+        // Arm or re-arm a timer: the callback runs from the first advance() at or after the deadline
+        void schedule(timer& t, clock::time_point deadline, const callback_t& callback)
+        {
+            t._callback = callback;
+            schedule(t, deadline);
+        }
+
+        // Re-arm a timer with its last callback
+        void schedule(timer& t, clock::time_point deadline)
+        {
+            if (t.armed()) unlink(t);
+            else _size++;
+
+            // rounded up to the next tick, and always in the future of the wheel
+            auto ticks = (deadline - _start + _tick - duration{ 1 }) / _tick;
+            t._expiry = ticks > static_cast<int64_t>(_now) ? static_cast<uint64_t>(ticks) : _now + 1;
+
+            insert(t);
+        }
+
+        void cancel(timer& t)
+        {
+            if (!t.armed()) return;
+            unlink(t);
+            _size--;
+        }
+
+        // Time when the timer would run, the end of its tick
+        inline clock::time_point deadline(const timer& t) const { return time_of(t._expiry); }
+
+        // Run the callbacks of the timers due at `now`, return how many ran
+        size_t advance(clock::time_point now)
+        {
+            auto count = size_t{ 0 };
+            if (now <= _start) return count;
+
+            auto target = static_cast<uint64_t>((now - _start) / _tick);
+            while (_now < target) {
+                if (!_size) {
+                    _now = target;
+                    break;
+                }
+
+                _now++;
+                auto index = _now & slot_mask;
+                if (index == 0) cascade(1);
+
+                // a callback may arm, re-arm or cancel any timer, but never in this slot: they are in the future
+                auto& head = _slots[0][index];
+                while (head) {
+                    auto& t = *head;
+                    unlink(t);
+                    _size--;
+
+                    auto callback = t._callback;
+                    callback();
+                    count++;
+                }
+            }
+            return count;
+        }
+
+        // The next time advance() may have callbacks to run: the next armed slot of level 0, or the next
+        //   cascade when level 0 is empty. clock::time_point::max() when no timer is armed.
+        clock::time_point next_deadline() const
+        {
+            if (!_size) return clock::time_point::max();
+
+            for (auto tick = _now + 1;; tick++) {
+                if ((tick & slot_mask) == 0 || _slots[0][tick & slot_mask]) return time_of(tick);
+            }
+        }
+
+    private:
+        static const unsigned levels    = 4;
+        static const unsigned slot_bits = 8;
+        static const uint64_t slot_mask = (1u << slot_bits) - 1;
+
+        clock::time_point time_of(uint64_t tick) const
+        {
+            return _start + _tick * static_cast<int64_t>(tick);
+        }
+
+        void insert(timer& t)
+        {
+            const auto max_delta = (uint64_t{ 1 } << (slot_bits * levels)) - 1;
+            if (t._expiry - _now > max_delta) t._expiry = _now + max_delta;
+
+            auto delta = t._expiry - _now;
+            auto level = 0u;
+            while (level + 1 < levels && delta >> (slot_bits * (level + 1))) level++;
+
+            auto& head = _slots[level][(t._expiry >> (slot_bits * level)) & slot_mask];
+            t._next = head;
+            if (head) head->_pprev = &t._next;
+            head = &t;
+            t._pprev = &head;
+        }
+
+        void unlink(timer& t)
+        {
+            *t._pprev = t._next;
+            if (t._next) t._next->_pprev = t._pprev;
+            t._pprev = nullptr;
+            t._next = nullptr;
+        }
+
+        // Spread the timers of the current slot of a level over the levels below
+        void cascade(unsigned level)
+        {
+            if (level >= levels) return;
+
+            auto index = (_now >> (slot_bits * level)) & slot_mask;
+            if (index == 0) cascade(level + 1);
+
+            auto t = _slots[level][index];
+            _slots[level][index] = nullptr;
+            while (t) {
+                auto next = t->_next;
+                t->_pprev = nullptr;
+                t->_next = nullptr;
+                insert(*t);
+                t = next;
+            }
+        }
+
+        duration          _tick;
+        clock::time_point _start;
+        uint64_t          _now = 0;    // ticks since start, all the timers up to it ran
+        size_t            _size = 0;
+
+        std::array<std::array<timer*, 1u << slot_bits>, levels> _slots;
+    };
+
+}
@@ -0,0 +1,189 @@
+#include <p2p/buffer.h>
+#include <cstring>
+#include <new>
+
+using namespace p2p;
+
+const size_t buffer_pool::min_block_size;
+const size_t buffer_pool::max_block_size;
+const size_t buffer_pool::size_classes;
+
+
+void shared_buffer::release()
+{
+    if (!_block) return;
+
+    if (_block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        _block->pool->recycle(_block);
+
+    _block = nullptr;
+    _size = 0;
+}
+
+
+namespace {
+    // Set once the cache of the thread is destroyed: the blocks released after that, by the
+    //   destructors of other thread_local objects, go straight to the free lists
+    thread_local bool cache_destroyed = false;
+}
+
+// Free blocks kept by a thread for the global pool, given back to it when the thread exits
+struct buffer_pool::thread_cache {
+    std::array<std::vector<block*>, size_classes> lists;
+    size_t                                        bytes = 0;
+
+    ~thread_cache()
+    {
+        cache_destroyed = true;
+        for (auto& list : lists)
+            for (auto b : list)
+                b->pool->push_free(b);
+    }
+};
+
+thread_local buffer_pool::thread_cache buffer_pool::_cache;
+
+
+namespace {
+
+    using block = details::buffer_block;
+
+    block* new_block(buffer_pool* pool, size_t capacity)
+    {
+        auto b = new (::operator new(sizeof(block) + capacity)) block;
+        b->capacity = capacity;
+        b->pool = pool;
+        return b;
+    }
+
+    void raise(std::atomic<size_t>& high_water, size_t value)
+    {
+        auto current = high_water.load(std::memory_order_relaxed);
+        while (value > current && !high_water.compare_exchange_weak(current, value, std::memory_order_relaxed));
+    }
+}
+
+
+buffer_pool& buffer_pool::global()
+{
+    // never destroyed: buffers may still be released while the process exits
+    static auto pool = new buffer_pool{ 64 * 1024 * 1024, 2 * 1024 * 1024 };
+    return *pool;
+}
+
+buffer_pool::buffer_pool(size_t max_idle_bytes, size_t thread_cache)
+    : _max_idle_bytes(max_idle_bytes), _thread_cache(thread_cache)
+    , _in_use_blocks(0), _in_use_bytes(0)
+    , _high_water_blocks(0), _high_water_bytes(0)
+    , _heap_bytes(0), _idle_bytes(0)
+{ }
+
+buffer_pool::~buffer_pool()
+{
+    for (auto& list : _free)
+        for (auto b : list.blocks)
+            ::operator delete(b);
+}
+
+size_t buffer_pool::size_class(size_t capacity)
+{
+    auto index = size_t{ 0 };
+    while (class_size(index) < capacity) index++;
+    return index;
+}
+
+shared_buffer buffer_pool::allocate(size_t capacity)
+{
+    if (capacity > max_block_size) {
+        auto b = new_block(this, capacity);
+        b->refs.store(1, std::memory_order_relaxed);
+        _heap_bytes.fetch_add(capacity, std::memory_order_relaxed);
+        on_acquire(capacity);
+        return shared_buffer{ b };
+    }
+
+    auto index = size_class(capacity);
+    auto b = static_cast<block*>(nullptr);
+
+    if (_thread_cache && !cache_destroyed && !_cache.lists[index].empty()) {
+        b = _cache.lists[index].back();
+        _cache.lists[index].pop_back();
+        _cache.bytes -= b->capacity;
+    }
+
+    if (!b) {
+        auto& list = _free[index];
+        std::lock_guard<std::mutex> lock(list.mutex);
+        if (!list.blocks.empty()) {
+            b = list.blocks.back();
+            list.blocks.pop_back();
+            _idle_bytes.fetch_sub(b->capacity, std::memory_order_relaxed);
+        }
+    }
+
+    if (!b) {
+        b = new_block(this, class_size(index));
+        _heap_bytes.fetch_add(b->capacity, std::memory_order_relaxed);
+    }
+
+    b->refs.store(1, std::memory_order_relaxed);
+    on_acquire(b->capacity);
+    return shared_buffer{ b };
+}
+
+shared_buffer buffer_pool::copy(multiformats::bufferview_t bytes)
+{
+    auto buffer = allocate(bytes.size());
+    if (!bytes.empty()) std::memcpy(buffer.data(), bytes.data(), bytes.size());
+    buffer.resize(bytes.size());
+    return buffer;
+}
+
+void buffer_pool::on_acquire(size_t bytes)
+{
+    raise(_high_water_blocks, _in_use_blocks.fetch_add(1, std::memory_order_relaxed) + 1);
+    raise(_high_water_bytes, _in_use_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+}
+
+void buffer_pool::recycle(block* b)
+{
+    _in_use_blocks.fetch_sub(1, std::memory_order_relaxed);
+    _in_use_bytes.fetch_sub(b->capacity, std::memory_order_relaxed);
+
+    if (b->capacity > max_block_size) {
+        _heap_bytes.fetch_sub(b->capacity, std::memory_order_relaxed);
+        return ::operator delete(b);
+    }
+
+    if (_thread_cache && !cache_destroyed && _cache.bytes + b->capacity <= _thread_cache) {
+        _cache.bytes += b->capacity;
+        return _cache.lists[size_class(b->capacity)].push_back(b);
+    }
+
+    push_free(b);
+}
+
+void buffer_pool::push_free(block* b)
+{
+    if (_idle_bytes.fetch_add(b->capacity, std::memory_order_relaxed) + b->capacity > _max_idle_bytes) {
+        _idle_bytes.fetch_sub(b->capacity, std::memory_order_relaxed);
+        _heap_bytes.fetch_sub(b->capacity, std::memory_order_relaxed);
+        return ::operator delete(b);
+    }
+
+    auto& list = _free[size_class(b->capacity)];
+    std::lock_guard<std::mutex> lock(list.mutex);
+    list.blocks.push_back(b);
+}
+
+buffer_pool::stats_t buffer_pool::stats() const
+{
+    auto stats = stats_t{};
+    stats.in_use_blocks = _in_use_blocks.load(std::memory_order_relaxed);
+    stats.in_use_bytes = _in_use_bytes.load(std::memory_order_relaxed);
+    stats.high_water_blocks = _high_water_blocks.load(std::memory_order_relaxed);
+    stats.high_water_bytes = _high_water_bytes.load(std::memory_order_relaxed);
+    stats.heap_bytes = _heap_bytes.load(std::memory_order_relaxed);
+    stats.idle_bytes = _idle_bytes.load(std::memory_order_relaxed);
+    return stats;
+}
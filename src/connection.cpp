@@ -0,0 +1,163 @@
+#include <p2p/connection.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace p2p;
+
+
+namespace {
+
+    // The fallback of send_file writes windows of 4 chunks of 64 KiB
+    const size_t chunk_size = 64 * 1024;
+    const size_t window     = 4;
+
+    // Read up to `size` bytes of a file at `offset`, -1 on error (errno)
+    long long read_at(int fd, uint64_t offset, byte* data, size_t size)
+    {
+#ifdef _WIN32
+        if (_lseeki64(fd, static_cast<long long>(offset), SEEK_SET) < 0) return -1;
+        return _read(fd, data, static_cast<unsigned>(size));
+#else
+        return ::pread(fd, data, size, static_cast<off_t>(offset));
+#endif
+    }
+
+    //
+    // file_reader runs the reads of the chunked files on a thread of its own, started with the first one:
+    //   a read missing the page cache would stall every connection of an io thread
+    //
+    class file_reader {
+    public:
+        static file_reader& global()
+        {
+            static file_reader reader;
+            return reader;
+        }
+
+        ~file_reader()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stopping = true;
+            lock.unlock();
+
+            _wake.notify_one();
+            if (_thread.joinable()) _thread.join();
+        }
+
+        void post(std::function<void()> task)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_thread.joinable()) _thread = std::thread([this]() { run(); });
+
+            _tasks.push_back(std::move(task));
+            _wake.notify_one();
+        }
+
+    private:
+        // Run the tasks in order, the ones left when stopping too
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;) {
+                _wake.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+                if (_tasks.empty()) return;
+
+                auto task = std::move(_tasks.front());
+                _tasks.pop_front();
+                lock.unlock();
+
+                task();
+                lock.lock();
+            }
+        }
+
+        std::mutex                        _mutex;
+        std::condition_variable           _wake;
+        std::deque<std::function<void()>> _tasks;
+        bool                              _stopping = false;
+        std::thread                       _thread;
+    };
+
+    //
+    // chunked_file sends a file through the public interface of a connection: it writes a window of
+    //   chunks, then waits for the connection to drain them under its low watermark before the next one.
+    //   The windows are read by the file_reader, the handler runs on the io thread of the connection.
+    //   It is owned by the drain handler it waits on, and by the read of a window in progress.
+    //
+    class chunked_file : public std::enable_shared_from_this<chunked_file>
+    {
+    public:
+        chunked_file(connection& conn, int fd, uint64_t offset, size_t length, const connection::send_file_handler_t& handler)
+            : _conn(conn), _fd(fd), _offset(offset), _remaining(length), _handler(handler)
+        { }
+
+        // Continue once the connection drained, on its io thread
+        void wait()
+        {
+            auto self(shared_from_this());
+            _conn.await_drain([self](std::error_code error) {
+                if (error) return self->_handler(error, self->_sent);
+                file_reader::global().post([self]() { self->next(); });
+            });
+        }
+
+    private:
+        // Read and write the next window, on the thread of the file_reader
+        void next()
+        {
+            for (auto i = size_t{ 0 }; i < window && _remaining; i++) {
+                auto size = (std::min)(_remaining, chunk_size);
+                auto chunk = buffer_pool::global().allocate(size);
+
+                auto length = read_at(_fd, _offset, chunk.data(), size);
+                if (length < 0) return done({ errno, std::generic_category() });
+
+                // the range goes past the end of the file
+                if (length == 0) return done(std::make_error_code(std::errc::invalid_argument));
+
+                chunk.resize(static_cast<size_t>(length));
+                _conn.write(chunk);
+
+                _offset += length;
+                _remaining -= static_cast<size_t>(length);
+                _sent += static_cast<size_t>(length);
+            }
+
+            if (!_remaining) return done({});
+            wait();
+        }
+
+        void done(const std::error_code& error)
+        {
+            auto self(shared_from_this());
+            _conn.post([self, error]() { self->_handler(error, self->_sent); });
+        }
+
+        connection&                     _conn;
+        int                             _fd;
+        uint64_t                        _offset;
+        size_t                          _remaining;
+        size_t                          _sent = 0;
+        connection::send_file_handler_t _handler;
+    };
+}
+
+
+void connection::send_file(int fd, uint64_t offset, size_t length, const send_file_handler_t& handler)
+{
+    // the first window is read once the messages written before are drained too
+    std::make_shared<chunked_file>(*this, fd, offset, length, handler)->wait();
+}
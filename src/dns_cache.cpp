@@ -0,0 +1,80 @@
+#include "dns_cache.h"
+
+using namespace p2p;
+
+
+dns_cache::dns_cache(const sp_io_pool& pool, std::chrono::seconds ttl)
+    : _pool(pool), _ttl(ttl)
+{ }
+
+void dns_cache::resolve(const asio::ip::tcp& protocol, const std::string& host, const std::string& port, const handler_t& handler)
+{
+    auto key = key_t{ protocol.family(), host, port };
+    auto now = clock::now();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto it = _entries.find(key);
+    if (it != _entries.end()) {
+        auto& entry = it->second;
+
+        if (!entry.waiting.empty()) {
+            _stats.coalesced++;
+            entry.waiting.push_back(handler);
+            return;
+        }
+
+        if (entry.expires > now) {
+            _stats.hits++;
+            auto results = entry.results;
+            lock.unlock();
+            return handler({}, results);
+        }
+    }
+    else {
+        // drop the expired names before adding a new one
+        for (auto e = _entries.begin(); e != _entries.end();) {
+            if (e->second.waiting.empty() && e->second.expires <= now) e = _entries.erase(e);
+            else e++;
+        }
+        it = _entries.emplace(key, entry_t{}).first;
+    }
+
+    _stats.misses++;
+    it->second.waiting.push_back(handler);
+    lock.unlock();
+
+    // one resolver per query: the lookups of a resolver are serialized on a private thread
+    auto self(shared_from_this());
+    auto resolver = std::make_shared<asio::ip::tcp::resolver>(_pool->next());
+    resolver->async_resolve(protocol, host, port, [self, resolver, key](asio::error_code error, const results_t& results) {
+        self->complete(key, error, results);
+    });
+}
+
+void dns_cache::complete(const key_t& key, const std::error_code& error, const results_t& results)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto& entry = _entries.at(key);
+    auto waiting = std::move(entry.waiting);
+    entry.waiting.clear();
+
+    if (error) {
+        _entries.erase(key);
+    }
+    else {
+        entry.results = results;
+        entry.expires = clock::now() + _ttl;
+    }
+    lock.unlock();
+
+    for (auto& handler : waiting)
+        handler(error, results);
+}
+
+dns_cache::stats_t dns_cache::stats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <p2p/transports/tcp.h>
+#include "io_pool.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+namespace p2p {
+
+    //
+    // dns_cache resolves the host names of the /dns4 and /dns6 multiaddrs and keeps the results for a TTL.
+    //   Concurrent lookups of the same name share a single query. Failed lookups are not cached.
+    //   The system resolver does not report the TTL of the records, so the TTL is a setting.
+    //   A query in flight keeps the cache, so that its handlers are called after the transport is gone.
+    //
+    class dns_cache : public std::enable_shared_from_this<dns_cache> {
+    public:
+        using results_t = asio::ip::tcp::resolver::results_type;
+        using handler_t = std::function<void(const std::error_code&, const results_t&)>;
+        using stats_t   = transports::resolve_stats;
+
+        dns_cache(const sp_io_pool& pool, std::chrono::seconds ttl);
+
+        // Resolve host:port for the protocol; the handler runs on an io thread of the pool,
+        //   or right away on a cache hit
+        void resolve(const asio::ip::tcp& protocol, const std::string& host, const std::string& port, const handler_t& handler);
+
+        stats_t stats() const;
+
+    private:
+        using clock = std::chrono::steady_clock;
+        using key_t = std::tuple<int, std::string, std::string>;
+
+        struct entry_t {
+            results_t              results;
+            clock::time_point      expires;
+            std::vector<handler_t> waiting;    // not empty while the query is in flight
+        };
+
+        void complete(const key_t& key, const std::error_code& error, const results_t& results);
+
+        sp_io_pool               _pool;
+        std::chrono::seconds     _ttl;
+
+        mutable std::mutex       _mutex;
+        std::map<key_t, entry_t> _entries;
+        stats_t                  _stats;
+    };
+
+}
@@ -0,0 +1,168 @@
+#include <p2p/framed_connection.h>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace p2p;
+
+
+size_t uvarint::encode(uint64_t value, byte* out)
+{
+    auto size = size_t{ 0 };
+    while (value >= 0x80) {
+        out[size++] = static_cast<byte>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<byte>(value);
+    return size;
+}
+
+int uvarint::decode(const byte* data, size_t size, uint64_t& value)
+{
+    value = 0;
+    for (auto i = size_t{ 0 }; i < (std::min)(size, max_size); i++) {
+        auto bits = static_cast<uint64_t>(data[i] & 0x7f);
+
+        // the 10th byte only has room for the 64th bit
+        if (i == max_size - 1 && data[i] > 1) return -1;
+
+        value |= bits << (7 * i);
+        if (!(data[i] & 0x80)) return static_cast<int>(i + 1);
+    }
+    return size >= max_size ? -1 : 0;
+}
+
+
+framed_connection::framed_connection(std::shared_ptr<p2p::connection> conn, size_t max_frame_size)
+    : _conn(std::move(conn)), _max_frame_size(max_frame_size)
+{ }
+
+void framed_connection::write(multiformats::bufferview_t msg)
+{
+    auto size = static_cast<size_t>(msg.size());
+    auto frame = buffer_pool::global().allocate(uvarint::max_size + size);
+
+    auto prefix = uvarint::encode(size, frame.data());
+    if (size) std::memcpy(frame.data() + prefix, msg.data(), size);
+    frame.resize(prefix + size);
+
+    _conn->write(frame);
+}
+
+void framed_connection::write(const shared_buffer& msg)
+{
+    auto prefix = buffer_pool::global().allocate(uvarint::max_size);
+    prefix.resize(uvarint::encode(msg.size(), prefix.data()));
+
+    _conn->write(prefix);
+    _conn->write(msg);
+}
+
+void framed_connection::read(const read_handler_t& handler)
+{
+    _handler = handler;
+
+    auto self(shared_from_this());
+    _conn->read(connection::borrowed_read_handler_t{ [self](std::error_code error, const borrowed_buffer& data) {
+        if (error) return self->fail(error);
+        self->on_read(data);
+    } });
+}
+
+void framed_connection::on_read(const borrowed_buffer& data)
+{
+    auto begin = data.begin();
+    auto next = begin;
+    auto left = data.size();
+    _frames.clear();
+
+    // complete the frame begun by the previous reads first
+    if (_stage.size() && !stage(next, left)) return;
+
+    // then the whole frames are lent straight from the receive buffer
+    while (left) {
+        auto length = uint64_t{ 0 };
+        auto prefix = uvarint::decode(next, left, length);
+        if (prefix < 0) return fail(std::make_error_code(std::errc::bad_message));
+        if (length > _max_frame_size) return fail(std::make_error_code(std::errc::message_size));
+        if (!prefix || prefix + length > left) break;
+
+        _frames.push_back(data.slice(static_cast<size_t>(next - begin) + prefix, static_cast<size_t>(length)));
+        next += prefix + length;
+        left -= prefix + static_cast<size_t>(length);
+    }
+
+    if (_frames.empty()) {
+        // nothing whole yet: stage what came and read on
+        if (left) _stage = buffer_pool::global().copy({ next, static_cast<std::ptrdiff_t>(left) });
+        return read(_handler);
+    }
+
+    // the rest begins the next frame: staged before the handler, which may read again
+    //   (the frames hold the previous staged frame and the receive buffer)
+    _stage = left ? buffer_pool::global().copy({ next, static_cast<std::ptrdiff_t>(left) }) : shared_buffer{};
+
+    auto handler = std::move(_handler);
+    _handler = nullptr;
+    handler({}, _frames);
+    _frames.clear();
+}
+
+// Append the received bytes to the staged frame, up to its end: false when it is still incomplete
+//   (the read goes on) or invalid (the connection failed)
+bool framed_connection::stage(const byte*& data, size_t& size)
+{
+    auto length = uint64_t{ 0 };
+    auto prefix = 0;
+
+    // the length prefix may be split too: it is completed a byte at a time
+    while ((prefix = uvarint::decode(_stage.data(), _stage.size(), length)) == 0 && size) {
+        if (_stage.capacity() == _stage.size()) {
+            auto grown = buffer_pool::global().allocate(_stage.size() + uvarint::max_size);
+            std::memcpy(grown.data(), _stage.data(), _stage.size());
+            grown.resize(_stage.size());
+            _stage = grown;
+        }
+        _stage.data()[_stage.size()] = *data++;
+        _stage.resize(_stage.size() + 1);
+        size--;
+    }
+
+    if (prefix < 0) return fail(std::make_error_code(std::errc::bad_message)), false;
+    if (length > _max_frame_size) return fail(std::make_error_code(std::errc::message_size)), false;
+
+    if (prefix) {
+        auto total = static_cast<size_t>(prefix + length);
+        if (_stage.capacity() < total) {
+            auto grown = buffer_pool::global().allocate(total);
+            std::memcpy(grown.data(), _stage.data(), _stage.size());
+            grown.resize(_stage.size());
+            _stage = grown;
+        }
+
+        auto count = (std::min)(total - _stage.size(), size);
+        if (count) std::memcpy(_stage.data() + _stage.size(), data, count);
+        _stage.resize(_stage.size() + count);
+        data += count;
+        size -= count;
+
+        if (_stage.size() == total) {
+            _frames.push_back(borrowed_buffer{ _stage, static_cast<size_t>(prefix), static_cast<size_t>(length) });
+            return true;
+        }
+    }
+
+    read(_handler);
+    return false;
+}
+
+void framed_connection::fail(std::error_code error)
+{
+    _frames.clear();
+    _stage = shared_buffer{};
+    if (error == std::errc::bad_message || error == std::errc::message_size) _conn->close();
+
+    auto handler = std::move(_handler);
+    _handler = nullptr;
+    if (handler) handler(error, _frames);
+}
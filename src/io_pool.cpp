@@ -0,0 +1,77 @@
+#include "io_pool.h"
+#include "timer_service.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+using namespace p2p;
+
+asio::execution_context::id timer_service::id;
+
+
+static void pin_to_core(std::thread& thread, size_t core)
+{
+#if defined(_WIN32)
+    SetThreadAffinityMask(thread.native_handle(), DWORD_PTR{ 1 } << core);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
+
+
+io_pool::io_pool(const options::io_t& opts)
+    : _next(0)
+{
+    auto cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    auto count = opts.threads ? opts.threads : cores;
+
+    // Only pin when every thread can have a core of its own
+    auto pin = opts.pin_threads && count <= cores;
+
+    for (auto i = size_t{ 0 }; i < count; i++) {
+        // A concurrency hint of 1 lets asio skip the locking of the handler queue
+        _contexts.push_back(std::make_shared<asio::io_context>(1));
+        _work.emplace_back(asio::make_work_guard(*_contexts.back()));
+
+        // the timers of the context, see timer_service.h
+        asio::make_service<timer_service>(*_contexts.back(), opts.timer_tick);
+    }
+
+    for (auto i = size_t{ 0 }; i < count; i++) {
+        auto ctx = _contexts[i];
+        _threads.emplace_back([ctx]() { ctx->run(); });
+
+        if (pin) pin_to_core(_threads.back(), i);
+    }
+}
+
+io_pool::~io_pool()
+{
+    stop();
+}
+
+asio::io_context& io_pool::next()
+{
+    return at(_next++ % _contexts.size());
+}
+
+void io_pool::stop()
+{
+    for (auto& ctx : _contexts)
+        ctx->stop();
+
+    for (auto& t : _threads) {
+        if (!t.joinable()) continue;
+
+        // the last reference may be released by one of our own handlers: the thread returns from it
+        //   to a stopped loop, its context lives until then
+        if (t.get_id() == std::this_thread::get_id())
+            t.detach();
+        else
+            t.join();
+    }
+}
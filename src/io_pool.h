@@ -0,0 +1,55 @@
+#pragma once
+
+#include <p2p/options.h>
+
+#ifdef _MSC_VER
+#include <SDKDDKVer.h>
+#endif
+
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace p2p {
+
+    //
+    // io_pool runs one io_context per thread, each thread pinned to its own core.
+    //   A connection is bound to one context for its whole life, so its handlers
+    //   never run concurrently and need no strand.
+    //   Each context has a timer_service for the timeouts of its connections.
+    //   Each thread shares the ownership of its context: a pool released by one of its own handlers
+    //   leaves that thread to finish the handler, and it destroys its context once run() returned.
+    //
+    class io_pool {
+    public:
+        explicit io_pool(const options::io_t& opts);
+        ~io_pool();
+
+        io_pool(const io_pool&) = delete;
+        io_pool& operator=(const io_pool&) = delete;
+
+        // Get the context of the next connection (round-robin)
+        asio::io_context& next();
+
+        inline asio::io_context& at(size_t index) { return *_contexts[index]; }
+        inline size_t            size() const     { return _contexts.size(); }
+
+        // Stop all the event loops and join their threads (but the calling one, when it is one of them)
+        void stop();
+
+    private:
+        using work_t = asio::executor_work_guard<asio::io_context::executor_type>;
+
+        std::vector<std::shared_ptr<asio::io_context>> _contexts;
+        std::vector<work_t>                            _work;
+        std::vector<std::thread>                       _threads;
+        std::atomic<size_t>                            _next;
+    };
+
+    using sp_io_pool = std::shared_ptr<io_pool>;
+}
@@ -0,0 +1,433 @@
+#include <p2p/transports/memory.h>
+#include <p2p/utils/spsc_ring.h>
+
+#include "io_pool.h"
+#include "write_counters.h"
+
+#include <deque>
+#include <map>
+#include <mutex>
+
+using namespace p2p;
+using namespace p2p::transports;
+using namespace multiformats;
+
+
+namespace {
+
+    // The name of a /memory/<name> multiaddr, empty when it is not one
+    std::string memory_name(const multiaddr& ma)
+    {
+        static const auto prefix = std::string{ "/memory/" };
+
+        auto str = ma.decapsulate(ipfs).str();
+        return str.compare(0, prefix.size(), prefix) == 0 ? str.substr(prefix.size()) : std::string{};
+    }
+
+
+    //
+    // channel carries the messages of one direction of a memory connection: its ring is filled by the
+    //   io thread of the writer, and emptied by the io thread of the reader.
+    //   A side waiting for the other one raises a flag, the other side posts it a wakeup when it sees it.
+    //
+    struct channel {
+        channel(const options& opts)
+            : ring(opts.memory.ring_size), low_watermark(opts.write.low_watermark)
+        { }
+
+        spsc_ring<shared_buffer> ring;
+        size_t                   low_watermark;
+
+        std::atomic<size_t> queued{ 0 };             // bytes written and not read yet
+        std::atomic<bool>   reader_waiting{ false }; // a read waits for a message
+        std::atomic<bool>   writer_room{ false };    // writes wait for the ring to be half empty
+        std::atomic<bool>   writer_drain{ false };   // await_drain waits for the low watermark
+
+        // Closed by either end: the writes are dropped, the reader gets eof once the ring is empty
+        std::atomic<bool>   closed{ false };
+    };
+
+
+    //
+    // memory_connection is one end of a connection between two peers of the process.
+    //   Each end runs on its own io thread, and shares the ownership of the io_pool of its transport.
+    //
+    class memory_connection : public p2p::connection, public std::enable_shared_from_this<memory_connection>
+    {
+    public:
+        memory_connection(const sp_io_pool& pool, asio::io_context& context, const options& opts, const std::shared_ptr<channel>& inbox, const std::shared_ptr<channel>& outbox)
+            : _pool(pool), _context(context), _opts(opts.write), _inbox(inbox), _outbox(outbox)
+        { }
+
+        ~memory_connection()
+        {
+            // as a socket closed by its destructor: the other end gets eof
+            _inbox->closed.store(true, std::memory_order_release);
+            _outbox->closed.store(true, std::memory_order_release);
+            wake_peer();
+        }
+
+        // Make two ends the peer of each other, before any of them is used
+        static void link(const std::shared_ptr<memory_connection>& a, const std::shared_ptr<memory_connection>& b)
+        {
+            a->_peer = b;
+            b->_peer = a;
+        }
+
+        asio::io_context& context() { return _context; }
+
+        void close()
+        {
+            _closed.store(true, std::memory_order_release);
+
+            auto self(shared_from_this());
+            asio::post(_context, [self, this]() { shutdown(asio::error::operation_aborted); });
+        }
+
+        bool is_open() const
+        {
+            return !_closed.load(std::memory_order_acquire);
+        }
+
+        void post(std::function<void()> task)
+        {
+            asio::post(_context, std::move(task));
+        }
+
+        void write(const multiformats::buffer_t& msg)
+        {
+            // the only copy of the message, into a pooled buffer
+            write(buffer_pool::global().copy(msg));
+        }
+
+        void write(const shared_buffer& msg)
+        {
+            _outbox->queued.fetch_add(msg.size(), std::memory_order_relaxed);
+
+            // the ring has a single producer: the io thread of this end
+            auto self(shared_from_this());
+            asio::dispatch(_context, [self, this, msg]() mutable
+            {
+                _backlog.push_back(std::move(msg));
+                flush();
+            });
+        }
+
+        bool try_write(const shared_buffer& msg)
+        {
+            if (_outbox->queued.load(std::memory_order_relaxed) >= _opts.high_watermark) return false;
+
+            write(msg);
+            return true;
+        }
+
+        void await_drain(const drain_handler_t& handler)
+        {
+            auto self(shared_from_this());
+            asio::post(_context, [self, this, handler]()
+            {
+                if (!is_open()) return handler(asio::error::not_connected);
+                if (_outbox->queued.load(std::memory_order_relaxed) <= _opts.low_watermark) return handler({});
+
+                _drain_handlers.push_back(handler);
+                flush();
+            });
+        }
+
+        size_t queued_bytes() const
+        {
+            return _outbox->queued.load(std::memory_order_relaxed);
+        }
+
+        void read(const read_handler_t& handler)
+        {
+            read(borrowed_read_handler_t{ [handler](std::error_code error, const borrowed_buffer& data) {
+                handler(error, multiformats::buffer_t{ data.begin(), data.end() });
+            } });
+        }
+
+        void read(const borrowed_read_handler_t& handler)
+        {
+            // posted even when a message is ready: a read never calls its handler from read()
+            auto self(shared_from_this());
+            asio::post(_context, [self, this, handler]()
+            {
+                if (_shut) return handler(asio::error::not_connected, {});
+
+                _reading = handler;
+                deliver();
+            });
+        }
+
+        write_stats stats() const
+        {
+            return _counters.snapshot();
+        }
+
+    private:
+        // Give the next message to the pending read, from the io thread
+        void deliver()
+        {
+            auto msg = shared_buffer{};
+            if (!_inbox->ring.pop(msg)) {
+                _inbox->reader_waiting.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                // the writer may have pushed before it saw the flag, or pushed then closed
+                auto closed = _inbox->closed.load(std::memory_order_acquire);
+                if (!_inbox->ring.pop(msg)) {
+                    if (closed) shutdown(asio::error::eof);
+                    return;
+                }
+                _inbox->reader_waiting.store(false, std::memory_order_relaxed);
+            }
+
+            auto queued = _inbox->queued.fetch_sub(msg.size(), std::memory_order_relaxed) - msg.size();
+
+            // resume the writer when it waits for what was just freed
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto wake = _inbox->ring.size() <= _inbox->ring.capacity() / 2 && take(_inbox->writer_room);
+            if (queued <= _inbox->low_watermark && take(_inbox->writer_drain)) wake = true;
+            if (wake) wake_peer();
+
+            auto handler = std::move(_reading);
+            _reading = nullptr;
+            handler({}, borrowed_buffer{ msg, msg.size() });
+        }
+
+        // Move the backlog into the ring and resume the drain handlers, from the io thread
+        void flush()
+        {
+            if (_outbox->closed.load(std::memory_order_acquire)) {
+                for (auto& msg : _backlog)
+                    _outbox->queued.fetch_sub(msg.size(), std::memory_order_relaxed);
+                _backlog.clear();
+
+                return drained(asio::error::connection_reset);
+            }
+
+            for (;;) {
+                auto pushed = false;
+                while (!_backlog.empty()) {
+                    auto size = _backlog.front().size();
+                    if (!_outbox->ring.push(std::move(_backlog.front()))) break;
+
+                    _backlog.pop_front();
+                    _counters.record(1, size);
+                    pushed = true;
+                }
+
+                if (pushed) {
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (take(_outbox->reader_waiting)) wake_peer();
+                }
+
+                if (_outbox->queued.load(std::memory_order_relaxed) <= _opts.low_watermark) drained({});
+                if (_backlog.empty() && _drain_handlers.empty()) return;
+
+                // wait for the reader, unless it made room in the meantime
+                auto& flag = _backlog.empty() ? _outbox->writer_drain : _outbox->writer_room;
+                flag.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                auto waiting = _backlog.empty()
+                    ? _outbox->queued.load(std::memory_order_relaxed) > _opts.low_watermark
+                    : _outbox->ring.size() == _outbox->ring.capacity();
+                if (waiting || !take(flag)) return;
+            }
+        }
+
+        // Run when the other end raised a flag of this one, or closed, from the io thread
+        void wakeup()
+        {
+            if (_reading) deliver();
+            if (!_shut) flush();
+        }
+
+        // Close both directions and fail the pending handlers, from the io thread
+        void shutdown(const std::error_code& error)
+        {
+            if (_shut) return;
+            _shut = true;
+
+            _closed.store(true, std::memory_order_release);
+            _inbox->closed.store(true, std::memory_order_release);
+            _outbox->closed.store(true, std::memory_order_release);
+            wake_peer();
+
+            // nothing more will be sent: drop the backlog
+            for (auto& msg : _backlog)
+                _outbox->queued.fetch_sub(msg.size(), std::memory_order_relaxed);
+            _backlog.clear();
+
+            if (_reading) {
+                auto handler = std::move(_reading);
+                _reading = nullptr;
+                handler(error, {});
+            }
+            drained(error);
+        }
+
+        void drained(const std::error_code& error)
+        {
+            auto handlers = std::move(_drain_handlers);
+            _drain_handlers.clear();
+
+            for (auto& handler : handlers)
+                handler(error);
+        }
+
+        // Clear a flag raised by the other end, true when it was raised
+        static bool take(std::atomic<bool>& flag)
+        {
+            return flag.load(std::memory_order_relaxed) && flag.exchange(false, std::memory_order_acq_rel);
+        }
+
+        void wake_peer()
+        {
+            if (auto peer = _peer.lock())
+                asio::post(peer->_context, [peer]() { peer->wakeup(); });
+        }
+
+    private:
+        sp_io_pool                        _pool;    // first: released last
+        asio::io_context&                 _context;
+        options::write_t                  _opts;
+        std::shared_ptr<channel>          _inbox;
+        std::shared_ptr<channel>          _outbox;
+        std::weak_ptr<memory_connection>  _peer;
+
+        std::atomic<bool>                 _closed{ false };
+        bool                              _shut = false;
+        borrowed_read_handler_t           _reading;
+        std::deque<shared_buffer>         _backlog;     // written while the ring is full
+        std::vector<drain_handler_t>      _drain_handlers;
+        write_counters                    _counters;
+    };
+
+
+    class memory_listener;
+
+    // The listeners of the process, by name
+    struct registry_t {
+        std::mutex                                            mutex;
+        std::map<std::string, std::weak_ptr<memory_listener>> listeners;
+    };
+
+    registry_t& registry()
+    {
+        static registry_t instance;
+        return instance;
+    }
+
+
+    //
+    // memory_listener accepts the connections dialed to its names, each on an io thread of its pool
+    //
+    class memory_listener : public listener, public std::enable_shared_from_this<memory_listener>
+    {
+    public:
+        memory_listener(const sp_io_pool& pool, const options& opts, const handler_t& handler)
+            : _pool(pool), _opts(opts), _handler(handler)
+        { }
+
+        ~memory_listener()
+        {
+            close();
+        }
+
+        multiaddr listen(const multiaddr& ma)
+        {
+            auto name = memory_name(ma);
+            if (name.empty()) throw std::invalid_argument("must be a /memory/<name> multiaddr");
+
+            auto& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+
+            auto& entry = reg.listeners[name];
+            if (!entry.expired()) throw std::system_error(asio::error::address_in_use);
+
+            entry = shared_from_this();
+            _names.push_back(name);
+            return ma;
+        }
+
+        void close()
+        {
+            auto& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+
+            for (auto& name : _names) {
+                auto it = reg.listeners.find(name);
+                if (it != reg.listeners.end() && (it->second.expired() || it->second.lock().get() == this))
+                    reg.listeners.erase(it);
+            }
+            _names.clear();
+        }
+
+        // Create the end of a dialed connection, and give it to the handler on its io thread
+        void accept(const std::shared_ptr<memory_connection>& client, const std::shared_ptr<channel>& inbox, const std::shared_ptr<channel>& outbox)
+        {
+            auto conn = std::make_shared<memory_connection>(_pool, _pool->next(), _opts, inbox, outbox);
+            memory_connection::link(client, conn);
+
+            auto handler = _handler;
+            asio::post(conn->context(), [handler, conn]() { if (handler) handler(conn); });
+        }
+
+    private:
+        sp_io_pool               _pool;
+        options                  _opts;
+        handler_t                _handler;
+        std::vector<std::string> _names;
+    };
+
+}
+
+
+p2p::transports::memory::memory(const options& opts)
+    : memory(std::make_shared<io_pool>(opts.io), opts)
+{ }
+
+p2p::transports::memory::memory(const std::shared_ptr<io_pool>& pool, const options& opts)
+    : _pool(pool), _opts(opts)
+{ }
+
+std::shared_ptr<connection> p2p::transports::memory::dial(const multiaddr& ma, const dial_handler_t& handler)
+{
+    auto to_server = std::make_shared<channel>(_opts);
+    auto to_client = std::make_shared<channel>(_opts);
+    auto conn = std::make_shared<memory_connection>(_pool, _pool->next(), _opts, to_client, to_server);
+
+    auto listener = std::shared_ptr<memory_listener>{};
+    {
+        auto& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+
+        auto it = reg.listeners.find(memory_name(ma));
+        if (it != reg.listeners.end()) listener = it->second.lock();
+    }
+
+    if (!listener) {
+        asio::post(conn->context(), [handler]() { handler(asio::error::connection_refused, nullptr); });
+        return conn;
+    }
+
+    listener->accept(conn, to_server, to_client);
+
+    asio::post(conn->context(), [conn, handler]() {
+        if (!conn->is_open()) return handler(asio::error::operation_aborted, nullptr);
+        handler({}, conn);
+    });
+    return conn;
+}
+
+sp_listener p2p::transports::memory::create_listener(const listener::handler_t& handler)
+{
+    return std::make_shared<memory_listener>(_pool, _opts, handler);
+}
+
+bool p2p::transports::memory::match(const multiformats::multiaddr& addr) const
+{
+    return !memory_name(addr).empty();
+}
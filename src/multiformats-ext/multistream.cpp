@@ -0,0 +1,369 @@
+#include <multiformats-ext/multistream.h>
+#include <p2p/framed_connection.h>
+
+#include <atomic>
+#include <cstring>
+
+using namespace multiformats;
+using namespace multiformats::multistream;
+
+
+const std::string multistream::protocol_id = "/multistream/1.0.0";
+
+std::string multistream::encode(const std::string& line)
+{
+    p2p::byte prefix[p2p::uvarint::max_size];
+    auto size = p2p::uvarint::encode(line.size() + 1, prefix);
+
+    auto message = std::string{ reinterpret_cast<const char*>(prefix), size };
+    message.reserve(size + line.size() + 1);
+    message += line;
+    message += '\n';
+    return message;
+}
+
+
+namespace {
+
+    const std::string na = "na";
+    const std::string ls = "ls";
+
+    // The longest message accepted, the list of the protocols included
+    const size_t max_message = 64 * 1024;
+
+    p2p::shared_buffer to_buffer(const std::string& bytes)
+    {
+        return p2p::buffer_pool::global().copy({ reinterpret_cast<const p2p::byte*>(bytes.data()), static_cast<std::ptrdiff_t>(bytes.size()) });
+    }
+
+    //
+    // message_reader splits the bytes received into messages
+    //
+    class message_reader {
+    public:
+        void append(const p2p::borrowed_buffer& data)
+        {
+            _buffer.append(reinterpret_cast<const char*>(data.data()), data.size());
+        }
+
+        // Take the next message, without its '\n': 1 when there was one, 0 when it is incomplete,
+        //   -1 when it is not a message
+        int next(std::string& line)
+        {
+            auto length = uint64_t{ 0 };
+            auto prefix = p2p::uvarint::decode(reinterpret_cast<const p2p::byte*>(_buffer.data()), _buffer.size(), length);
+            if (prefix < 0 || length > max_message) return -1;
+            if (!prefix || _buffer.size() < prefix + length) return 0;
+            if (!length || _buffer[static_cast<size_t>(prefix + length - 1)] != '\n') return -1;
+
+            line.assign(_buffer, static_cast<size_t>(prefix), static_cast<size_t>(length - 1));
+            _buffer.erase(0, static_cast<size_t>(prefix + length));
+            return 1;
+        }
+
+        // The bytes received after the last message taken
+        const std::string& rest() const { return _buffer; }
+
+    private:
+        std::string _buffer;
+    };
+
+
+    //
+    // negotiated_connection is a connection on which a protocol was negotiated.
+    //   After a negotiation, it first reads the bytes received along with the last answer.
+    //   After a lazy proposal, it sends the proposal with its first write, and checks that the first
+    //   bytes read are the expected answer.
+    //
+    class negotiated_connection : public p2p::connection, public std::enable_shared_from_this<negotiated_connection>
+    {
+    public:
+        negotiated_connection(std::shared_ptr<p2p::connection> conn, const std::string& leftover)
+            : _conn(std::move(conn)), _leftover(leftover), _proposed(true)
+        { }
+
+        negotiated_connection(std::shared_ptr<p2p::connection> conn, const std::string& proposal, const std::string& answer)
+            : _conn(std::move(conn)), _proposal(proposal), _answer(answer), _proposed(false)
+        { }
+
+        void write(const multiformats::buffer_t& msg)
+        {
+            write(p2p::buffer_pool::global().copy(msg));
+        }
+
+        void write(const p2p::shared_buffer& msg)
+        {
+            if (!propose(&msg)) _conn->write(msg);
+        }
+
+        bool try_write(const p2p::shared_buffer& msg)
+        {
+            if (propose(&msg)) return true;
+            return _conn->try_write(msg);
+        }
+
+        void await_drain(const drain_handler_t& handler) { _conn->await_drain(handler); }
+        size_t queued_bytes() const { return _conn->queued_bytes(); }
+
+        void read(const read_handler_t& handler)
+        {
+            read(borrowed_read_handler_t{ [handler](std::error_code error, const p2p::borrowed_buffer& data) {
+                handler(error, multiformats::buffer_t{ data.begin(), data.end() });
+            } });
+        }
+
+        void read(const borrowed_read_handler_t& handler)
+        {
+            // the answer would never come otherwise
+            propose(nullptr);
+
+            if (!_leftover.empty()) {
+                auto self(shared_from_this());
+                return _conn->post([self, this, handler]() {
+                    auto leftover = to_buffer(_leftover);
+                    _leftover.clear();
+                    handler({}, p2p::borrowed_buffer{ leftover, leftover.size() });
+                });
+            }
+            if (_answer.empty()) return _conn->read(handler);
+
+            auto self(shared_from_this());
+            _conn->read(borrowed_read_handler_t{ [self, this, handler](std::error_code error, const p2p::borrowed_buffer& data) {
+                if (error) return handler(error, {});
+
+                // the answer may come in pieces, and the first bytes of the protocol after it
+                auto size = (std::min)(_answer.size(), data.size());
+                if (std::memcmp(_answer.data(), data.data(), size) != 0) {
+                    _conn->close();
+                    return handler(std::make_error_code(std::errc::protocol_not_supported), {});
+                }
+                _answer.erase(0, size);
+
+                if (data.size() > size) return handler({}, data.slice(size, data.size() - size));
+                read(handler);
+            } });
+        }
+
+        void close() { _conn->close(); }
+        bool is_open() const { return _conn->is_open(); }
+        void post(std::function<void()> task) { _conn->post(std::move(task)); }
+        p2p::write_stats stats() const { return _conn->stats(); }
+
+    private:
+        // Send the lazy proposal once, with the first message: true when the message went with it
+        bool propose(const p2p::shared_buffer* msg)
+        {
+            if (_proposed.load(std::memory_order_acquire)) return false;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_proposed.load(std::memory_order_relaxed)) return false;
+
+            // one buffer, sent by one write
+            auto size = _proposal.size() + (msg ? msg->size() : 0);
+            auto buffer = p2p::buffer_pool::global().allocate(size);
+            std::memcpy(buffer.data(), _proposal.data(), _proposal.size());
+            if (msg && msg->size()) std::memcpy(buffer.data() + _proposal.size(), msg->data(), msg->size());
+            buffer.resize(size);
+            _conn->write(buffer);
+
+            _proposed.store(true, std::memory_order_release);
+            return msg != nullptr;
+        }
+
+        std::shared_ptr<p2p::connection> _conn;
+        std::string                      _leftover;  // received after the answer, read first
+        std::string                      _proposal;  // sent with the first write
+        std::string                      _answer;    // expected first
+        std::atomic<bool>                _proposed;
+        std::mutex                       _mutex;
+    };
+
+    std::shared_ptr<p2p::connection> negotiated(std::shared_ptr<p2p::connection> conn, const std::string& leftover)
+    {
+        if (leftover.empty()) return conn;
+        return std::make_shared<negotiated_connection>(std::move(conn), leftover);
+    }
+
+
+    //
+    // selection is a negotiation of the dialer: it proposes the protocols in turn
+    //
+    class selection : public std::enable_shared_from_this<selection>
+    {
+    public:
+        selection(std::shared_ptr<p2p::connection> conn, const std::vector<std::string>& protocols, const dialer::select_handler_t& handler)
+            : _conn(std::move(conn)), _protocols(protocols), _handler(handler)
+        { }
+
+        void start()
+        {
+            if (_protocols.empty()) return fail(std::errc::protocol_not_supported);
+
+            // the header and the first proposal go together
+            _conn->write(to_buffer(encode(protocol_id) + encode(_protocols[0])));
+            read();
+        }
+
+    private:
+        void read()
+        {
+            auto self(shared_from_this());
+            _conn->read(p2p::connection::borrowed_read_handler_t{ [self, this](std::error_code error, const p2p::borrowed_buffer& data) {
+                if (error) return finish(error);
+
+                _reader.append(data);
+                for (;;) {
+                    auto line = std::string{};
+                    auto result = _reader.next(line);
+                    if (result < 0) return fail(std::errc::protocol_error);
+                    if (!result) return read();
+
+                    if (!_header) {
+                        if (line != protocol_id) return fail(std::errc::protocol_error);
+                        _header = true;
+                        continue;
+                    }
+
+                    if (line == _protocols[_next]) return finish({}, line);
+                    if (line != na) return fail(std::errc::protocol_error);
+                    if (++_next == _protocols.size()) return fail(std::errc::protocol_not_supported);
+                    _conn->write(to_buffer(encode(_protocols[_next])));
+                }
+            } });
+        }
+
+        void fail(std::errc error)
+        {
+            _conn->close();
+            finish(std::make_error_code(error));
+        }
+
+        void finish(std::error_code error, const std::string& protocol = {})
+        {
+            if (error) return _handler(error, nullptr, protocol);
+            _handler(error, negotiated(_conn, _reader.rest()), protocol);
+        }
+
+        std::shared_ptr<p2p::connection> _conn;
+        std::vector<std::string>         _protocols;
+        dialer::select_handler_t         _handler;
+        message_reader                   _reader;
+        size_t                           _next = 0;
+        bool                             _header = false;
+    };
+}
+
+
+void dialer::select(std::shared_ptr<p2p::connection> conn, const std::vector<std::string>& protocols, const select_handler_t& handler)
+{
+    std::make_shared<selection>(std::move(conn), protocols, handler)->start();
+}
+
+std::shared_ptr<p2p::connection> dialer::select_lazy(std::shared_ptr<p2p::connection> conn, const std::string& protocol)
+{
+    // the listener answers with the same messages when it accepts
+    auto messages = encode(protocol_id) + encode(protocol);
+    return std::make_shared<negotiated_connection>(std::move(conn), messages, messages);
+}
+
+
+//
+// negotiation is a negotiation of the listener: it answers the proposals until it accepts one
+//
+class multistream::negotiation : public std::enable_shared_from_this<negotiation>
+{
+public:
+    negotiation(std::shared_ptr<listener> owner, std::shared_ptr<p2p::connection> conn, const listener::fallback_t& fallback)
+        : _owner(std::move(owner)), _conn(std::move(conn)), _fallback(fallback)
+    { }
+
+    void read()
+    {
+        auto self(shared_from_this());
+        _conn->read(p2p::connection::borrowed_read_handler_t{ [self, this](std::error_code error, const p2p::borrowed_buffer& data) {
+            if (error) return;
+
+            _reader.append(data);
+
+            // not a dialer: the fallback reads the bytes received again
+            if (!_header && _fallback) {
+                static const auto header = encode(protocol_id);
+                auto& received = _reader.rest();
+                auto size = (std::min)(received.size(), header.size());
+                if (received.compare(0, size, header, 0, size) != 0) return _fallback(negotiated(_conn, received));
+            }
+
+            // the answers to the messages of a read go together
+            auto answers = std::string{};
+            for (;;) {
+                auto line = std::string{};
+                auto result = _reader.next(line);
+                if (result < 0) return _conn->close();
+                if (!result) break;
+
+                if (!_header) {
+                    if (line != protocol_id) return _conn->close();
+                    _header = true;
+                    answers += encode(protocol_id);
+                    continue;
+                }
+
+                auto handler = listener::handler_t{};
+                if (line == ls) {
+                    auto list = std::string{};
+                    for (auto& protocol : _owner->protocols()) list += encode(protocol);
+                    answers += encode(list);
+                }
+                else if (_owner->find(line, handler)) {
+                    _conn->write(to_buffer(answers + encode(line)));
+                    return handler(negotiated(_conn, _reader.rest()), line);
+                }
+                else answers += encode(na);
+            }
+
+            if (!answers.empty()) _conn->write(to_buffer(answers));
+            read();
+        } });
+    }
+
+private:
+    std::shared_ptr<listener>        _owner;
+    std::shared_ptr<p2p::connection> _conn;
+    listener::fallback_t             _fallback;
+    message_reader                   _reader;
+    bool                             _header = false;
+};
+
+
+listener::listener()
+    : _handlers(std::make_shared<p2p::protocol_table>())
+{ }
+
+listener::listener(std::shared_ptr<p2p::protocol_table> handlers)
+    : _handlers(std::move(handlers))
+{ }
+
+void listener::add(const std::string& protocol, const handler_t& handler)
+{
+    _handlers->add(protocol, handler);
+}
+
+void listener::remove(const std::string& protocol)
+{
+    _handlers->remove(protocol);
+}
+
+std::vector<std::string> listener::protocols() const
+{
+    return _handlers->protocols();
+}
+
+void listener::handle(std::shared_ptr<p2p::connection> conn, const fallback_t& fallback)
+{
+    std::make_shared<negotiation>(shared_from_this(), std::move(conn), fallback)->read();
+}
+
+bool listener::find(const std::string& protocol, handler_t& handler) const
+{
+    return _handlers->route(protocol, handler);
+}
@@ -0,0 +1,640 @@
+#include <p2p/muxer.h>
+
+#include <p2p/utils/timer_wheel.h>
+
+#include "io_pool.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace p2p;
+
+
+namespace {
+
+    const uint8_t version = 0;
+
+    // frame types
+    const uint8_t type_data          = 0;
+    const uint8_t type_window_update = 1;
+    const uint8_t type_ping          = 2;
+    const uint8_t type_go_away       = 3;
+
+    // frame flags
+    const uint16_t flag_syn = 1;
+    const uint16_t flag_ack = 2;
+    const uint16_t flag_fin = 4;
+    const uint16_t flag_rst = 8;
+
+    // go away reasons
+    const uint32_t go_away_normal         = 0;
+    const uint32_t go_away_protocol_error = 1;
+
+    const size_t   header_size = 12;
+
+    // The window of a new stream, before any window update
+    const uint32_t initial_window = 256 * 1024;
+
+    // A payload up to this size is copied after its header, the larger ones are written after it
+    const size_t   inline_payload = 512;
+
+    void put16(byte* out, uint16_t value)
+    {
+        out[0] = static_cast<byte>(value >> 8);
+        out[1] = static_cast<byte>(value);
+    }
+
+    void put32(byte* out, uint32_t value)
+    {
+        out[0] = static_cast<byte>(value >> 24);
+        out[1] = static_cast<byte>(value >> 16);
+        out[2] = static_cast<byte>(value >> 8);
+        out[3] = static_cast<byte>(value);
+    }
+
+    uint16_t get16(const byte* in)
+    {
+        return static_cast<uint16_t>(in[0] << 8 | in[1]);
+    }
+
+    uint32_t get32(const byte* in)
+    {
+        return static_cast<uint32_t>(in[0]) << 24 | static_cast<uint32_t>(in[1]) << 16 | static_cast<uint32_t>(in[2]) << 8 | in[3];
+    }
+
+    //
+    // half_close_timers times the streams closed on this side until the FIN of the peer, on a thread of its
+    //   own started with the first one: a muxer only knows its connection, not its io_context.
+    //   The callbacks run once the lock is released, they post the timeout to the io thread of the stream.
+    //
+    class half_close_timers {
+    public:
+        using timer = timer_wheel::timer;
+
+        static half_close_timers& global()
+        {
+            static half_close_timers timers;
+            return timers;
+        }
+
+        ~half_close_timers()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stopping = true;
+            lock.unlock();
+
+            _wake.notify_one();
+            if (_thread.joinable()) _thread.join();
+        }
+
+        void schedule(timer& t, timer_wheel::duration delay, const timer_wheel::callback_t& callback)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_thread.joinable()) _thread = std::thread([this]() { run(); });
+
+            _wheel.schedule(t, timer_wheel::clock::now() + delay, [this, callback]() { _due.push_back(callback); });
+            _wake.notify_one();
+        }
+
+        void cancel(timer& t)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _wheel.cancel(t);
+        }
+
+    private:
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (!_stopping) {
+                if (_wheel.empty()) _wake.wait(lock);
+                else _wake.wait_until(lock, _wheel.next_deadline());
+                _wheel.advance(timer_wheel::clock::now());
+
+                auto due = std::move(_due);
+                _due.clear();
+                lock.unlock();
+
+                for (auto& callback : due) callback();
+                due.clear();
+                lock.lock();
+            }
+        }
+
+        std::mutex                              _mutex;
+        std::condition_variable                 _wake;
+        timer_wheel                             _wheel{ std::chrono::milliseconds{ 100 } };
+        std::vector<timer_wheel::callback_t>    _due;
+        bool                                    _stopping = false;
+        std::thread                             _thread;
+    };
+}
+
+
+//
+// muxer_stream is a stream of a muxer. Its writes wait in its own queue for its send window, then
+//   go to the connection as data frames. The payloads received wait in its inbox for its reads,
+//   and the window goes back to the peer as they are read.
+//   Its state belongs to the io thread of the connection, except the counters of its public interface.
+//
+class p2p::muxer_stream : public connection, public std::enable_shared_from_this<muxer_stream>
+{
+public:
+    muxer_stream(std::shared_ptr<muxer> mux, uint32_t id)
+        : _mux(std::move(mux)), _id(id), _opts(_mux->_opts.write), _recv_window(_mux->_opts.mux.window)
+    { }
+
+    ~muxer_stream()
+    {
+        if (_half_closed) half_close_timers::global().cancel(_half_close_timer);
+    }
+
+    inline uint32_t id() const { return _id; }
+
+    void write(const multiformats::buffer_t& msg)
+    {
+        // the only copy of the message, into a pooled buffer
+        write(buffer_pool::global().copy(msg));
+    }
+
+    void write(const shared_buffer& msg)
+    {
+        if (!msg.size()) return;
+        _queued.fetch_add(msg.size(), std::memory_order_relaxed);
+
+        auto self(shared_from_this());
+        post([self, this, msg]() {
+            if (_write_closed) {
+                _queued.fetch_sub(msg.size(), std::memory_order_relaxed);
+                return;
+            }
+            _pending.push_back(msg);
+            _mux->flush(*this);
+        });
+    }
+
+    bool try_write(const shared_buffer& msg)
+    {
+        if (_queued.load(std::memory_order_relaxed) >= _opts.high_watermark) return false;
+        if (_mux->_conn->queued_bytes() >= _opts.high_watermark) return false;
+
+        write(msg);
+        return true;
+    }
+
+    // Drained once the stream sent its queue under the low watermark, then the connection did
+    void await_drain(const drain_handler_t& handler)
+    {
+        auto self(shared_from_this());
+        post([self, this, handler]() {
+            if (_write_closed) return handler(asio::error::not_connected);
+            if (_queued.load(std::memory_order_relaxed) <= _opts.low_watermark) return _mux->_conn->await_drain(handler);
+
+            _drain_handlers.push_back(handler);
+        });
+    }
+
+    size_t queued_bytes() const
+    {
+        return _queued.load(std::memory_order_relaxed);
+    }
+
+    void read(const read_handler_t& handler)
+    {
+        read(borrowed_read_handler_t{ [handler](std::error_code error, const borrowed_buffer& data) {
+            handler(error, multiformats::buffer_t{ data.begin(), data.end() });
+        } });
+    }
+
+    void read(const borrowed_read_handler_t& handler)
+    {
+        // posted even when a payload is ready: a read never calls its handler from read()
+        auto self(shared_from_this());
+        post([self, this, handler]() {
+            if (_read_closed) return handler(_error ? _error : asio::error::not_connected, {});
+
+            _reading = handler;
+            deliver();
+        });
+    }
+
+    // Send the queued writes and a FIN, then read on until the FIN of the peer: the stream goes away once
+    //   the peer closed its side too, or it is reset after the half-close timeout
+    void close()
+    {
+        _closed.store(true, std::memory_order_release);
+
+        auto self(shared_from_this());
+        post([self, this]() {
+            if (_write_closed) return;
+            _write_closed = true;
+            _mux->flush(*this);
+        });
+    }
+
+    bool is_open() const
+    {
+        return !_closed.load(std::memory_order_acquire);
+    }
+
+    void post(std::function<void()> task)
+    {
+        _mux->_conn->post(std::move(task));
+    }
+
+private:
+    friend class muxer;
+
+    // Give the next payload to the pending read, and its window back to the peer
+    void deliver()
+    {
+        if (!_reading) return;
+
+        if (_inbox.empty()) {
+            if (!_fin_received && !_error) return;
+            return stop_reading(_error ? _error : asio::error::eof);
+        }
+
+        auto msg = std::move(_inbox.front());
+        _inbox.pop_front();
+        credit(static_cast<uint32_t>(msg.size()));
+
+        auto handler = std::move(_reading);
+        _reading = nullptr;
+        handler({}, borrowed_buffer{ msg, msg.size() });
+    }
+
+    // Count bytes read, the window is updated once half of it was read
+    void credit(uint32_t size)
+    {
+        _consumed += size;
+        if (_consumed < _mux->_opts.mux.window / 2 || _fin_received || _reset) return;
+
+        _mux->send(type_window_update, 0, _id, _consumed);
+        _recv_window += _consumed;
+        _consumed = 0;
+    }
+
+    // No more reads: fail the pending one, drop the payloads received
+    void stop_reading(std::error_code error)
+    {
+        _read_closed = true;
+        if (!_error) _error = error;
+
+        for (auto& msg : _inbox) credit(static_cast<uint32_t>(msg.size()));
+        _inbox.clear();
+
+        if (_reading) {
+            auto handler = std::move(_reading);
+            _reading = nullptr;
+            handler(error, {});
+        }
+    }
+
+    // Wait for the FIN of the peer once the FIN was sent, from the io thread
+    void half_close()
+    {
+        if (_fin_received || _reset || !_mux->_opts.mux.half_close_timeout.count()) return;
+        _half_closed = true;
+
+        auto weak = std::weak_ptr<muxer_stream>{ shared_from_this() };
+        half_close_timers::global().schedule(_half_close_timer, _mux->_opts.mux.half_close_timeout, [weak]() {
+            auto self = weak.lock();
+            if (self) self->post([self]() { self->_mux->expire(*self); });
+        });
+    }
+
+    // Reset by the peer, or the connection failed
+    void fail(std::error_code error)
+    {
+        _closed.store(true, std::memory_order_release);
+        _error = error;
+        _reset = true;
+        _write_closed = true;
+        _fin_sent = true;
+
+        for (auto& msg : _pending) _queued.fetch_sub(msg.size(), std::memory_order_relaxed);
+        _pending.clear();
+
+        // the payloads received are still read, then the error
+        if (_inbox.empty()) stop_reading(error);
+        drained(error);
+    }
+
+    void drained(std::error_code error)
+    {
+        auto handlers = std::move(_drain_handlers);
+        _drain_handlers.clear();
+
+        for (auto& handler : handlers) {
+            if (error) handler(error);
+            else _mux->_conn->await_drain(handler);
+        }
+    }
+
+    std::shared_ptr<muxer>          _mux;
+    uint32_t                        _id;
+    options::write_t                _opts;
+
+    std::atomic<bool>               _closed{ false };
+    std::atomic<size_t>             _queued{ 0 };   // bytes written, not framed yet
+
+    // writes
+    bool                            _announced = false;   // the SYN was sent, or the peer opened the stream
+    std::deque<shared_buffer>       _pending;
+    uint32_t                        _send_window = initial_window;
+    bool                            _write_closed = false;
+    bool                            _fin_sent = false;
+    std::vector<drain_handler_t>    _drain_handlers;
+
+    // reads
+    std::deque<shared_buffer>       _inbox;
+    borrowed_read_handler_t         _reading;
+    uint32_t                        _recv_window;    // bytes the peer may still send
+    uint32_t                        _consumed = 0;   // bytes read, not given back to the peer yet
+    bool                            _fin_received = false;
+    bool                            _read_closed = false;
+    bool                            _reset = false;
+    std::error_code                 _error;
+
+    // closed on this side, waiting for the FIN of the peer
+    bool                            _half_closed = false;
+    half_close_timers::timer        _half_close_timer;
+};
+
+
+muxer::muxer(std::shared_ptr<p2p::connection> conn, role_t role, const options& opts)
+    : _conn(std::move(conn)), _role(role), _opts(opts), _next_id(role == role_t::initiator ? 1 : 2)
+{
+    if (_opts.mux.window < initial_window) _opts.mux.window = initial_window;
+}
+
+void muxer::start(const stream_handler_t& handler)
+{
+    _handler = handler;
+    read();
+}
+
+std::shared_ptr<connection> muxer::open()
+{
+    auto stream = std::make_shared<muxer_stream>(shared_from_this(), _next_id.fetch_add(2, std::memory_order_relaxed));
+
+    // the first writes may be posted from another thread, and run before this post: the first of
+    //   them to run on the io thread sends the SYN
+    auto self(shared_from_this());
+    _conn->post([self, stream]() { self->announce(*stream); });
+    return stream;
+}
+
+void muxer::close()
+{
+    auto self(shared_from_this());
+    _conn->post([self]() { self->shutdown(asio::error::operation_aborted, go_away_normal); });
+}
+
+void muxer::read()
+{
+    auto self(shared_from_this());
+    _conn->read(connection::borrowed_read_handler_t{ [self](std::error_code error, const borrowed_buffer& data) {
+        if (error) return self->shutdown(error, go_away_normal);
+
+        self->on_read(data);
+        if (!self->_shut) self->read();
+    } });
+}
+
+// Split the bytes received into frames: a frame may span several reads
+void muxer::on_read(const borrowed_buffer& data)
+{
+    auto next = data.begin();
+    auto left = data.size();
+
+    while (left && !_shut) {
+        if (_in_payload) {
+            auto count = (std::min)(static_cast<size_t>(_frame.length) - _payload.size(), left);
+            std::memcpy(_payload.data() + _payload.size(), next, count);
+            _payload.resize(_payload.size() + count);
+            next += count;
+            left -= count;
+
+            if (_payload.size() < _frame.length) return;
+            _in_payload = false;
+
+            auto payload = std::move(_payload);
+            _payload = shared_buffer{};
+            on_frame(_frame, payload);
+            continue;
+        }
+
+        auto count = (std::min)(header_size - _header_size, left);
+        std::memcpy(_header + _header_size, next, count);
+        _header_size += count;
+        next += count;
+        left -= count;
+        if (_header_size < header_size) return;
+        _header_size = 0;
+
+        _frame = frame_t{ _header[0], _header[1], get16(_header + 2), get32(_header + 4), get32(_header + 8) };
+        if (_frame.version != version || _frame.type > type_go_away) return shutdown(asio::error::connection_reset, go_away_protocol_error);
+
+        if (_frame.type == type_data && _frame.length) {
+            // no stream may receive more than its window
+            if (_frame.length > _opts.mux.window) return shutdown(asio::error::message_size, go_away_protocol_error);
+
+            _payload = buffer_pool::global().allocate(_frame.length);
+            _payload.resize(0);
+            _in_payload = true;
+            continue;
+        }
+        on_frame(_frame, {});
+    }
+}
+
+void muxer::on_frame(const frame_t& frame, const shared_buffer& payload)
+{
+    switch (frame.type) {
+    case type_ping:
+        if (frame.flags & flag_syn) send(type_ping, flag_ack, 0, frame.length);
+        return;
+
+    case type_go_away:
+        // the streams open go on, the peer takes no new ones
+        _going_away = true;
+        return;
+    }
+
+    if (frame.flags & flag_syn) return accept(frame, payload);
+
+    auto it = _streams.find(frame.stream);
+    if (it == _streams.end()) return;  // closed meanwhile
+    auto stream = it->second;
+
+    if (frame.flags & flag_rst) {
+        stream->fail(asio::error::connection_reset);
+        return release(*stream);
+    }
+
+    if (frame.type == type_window_update) {
+        stream->_send_window += frame.length;
+        flush(*stream);
+    }
+    else if (frame.length) {
+        if (frame.length > stream->_recv_window) return shutdown(asio::error::message_size, go_away_protocol_error);
+        stream->_recv_window -= frame.length;
+
+        if (stream->_read_closed) stream->credit(frame.length);
+        else stream->_inbox.push_back(payload);
+    }
+
+    if (frame.flags & flag_fin) {
+        stream->_fin_received = true;
+        if (stream->_fin_sent) release(*stream);
+    }
+    stream->deliver();
+}
+
+// A stream opened by the peer
+void muxer::accept(const frame_t& frame, const shared_buffer& payload)
+{
+    auto odd = (frame.stream & 1) != 0;
+    if (!frame.stream || odd == (_role == role_t::initiator) || _streams.count(frame.stream))
+        return shutdown(asio::error::connection_reset, go_away_protocol_error);
+
+    if (_inbound >= _opts.mux.max_streams || (frame.flags & flag_rst)) {
+        if (!(frame.flags & flag_rst)) send(type_window_update, flag_rst, frame.stream, 0);
+        return;
+    }
+
+    auto stream = std::make_shared<muxer_stream>(shared_from_this(), frame.stream);
+    stream->_announced = true;
+    _streams.emplace(frame.stream, stream);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _inbound++;
+
+    send(type_window_update, flag_ack, frame.stream, _opts.mux.window - initial_window);
+
+    // the rest of the frame applies to the new stream
+    on_frame({ frame.version, frame.type, static_cast<uint16_t>(frame.flags & ~flag_syn), frame.stream, frame.length }, payload);
+    if (_handler) _handler(stream);
+}
+
+void muxer::send(uint8_t type, uint16_t flags, uint32_t stream, uint32_t length, const shared_buffer* payload)
+{
+    auto inline_size = payload && payload->size() <= inline_payload ? payload->size() : 0;
+
+    auto frame = buffer_pool::global().allocate(header_size + inline_size);
+    frame.data()[0] = version;
+    frame.data()[1] = type;
+    put16(frame.data() + 2, flags);
+    put32(frame.data() + 4, stream);
+    put32(frame.data() + 8, length);
+    if (inline_size) std::memcpy(frame.data() + header_size, payload->data(), inline_size);
+    frame.resize(header_size + inline_size);
+
+    _conn->write(frame);
+    if (payload && !inline_size) _conn->write(*payload);
+}
+
+// Send the SYN of a stream opened on this side, before any other frame of it: false when it failed.
+//   The SYN carries the window past the initial one.
+bool muxer::announce(muxer_stream& stream)
+{
+    if (stream._announced) return !stream._reset;
+    stream._announced = true;
+
+    if (_shut) {
+        stream.fail(asio::error::not_connected);
+        return false;
+    }
+    if (_going_away) {
+        stream.fail(asio::error::connection_refused);
+        return false;
+    }
+
+    _streams.emplace(stream._id, stream.shared_from_this());
+    _count.fetch_add(1, std::memory_order_relaxed);
+    send(type_window_update, flag_syn, stream._id, _opts.mux.window - initial_window);
+    return true;
+}
+
+// Frame the writes of a stream its send window allows, then its FIN once it was closed
+void muxer::flush(muxer_stream& stream)
+{
+    if (!announce(stream)) return;
+
+    while (!stream._pending.empty() && stream._send_window) {
+        auto msg = std::move(stream._pending.front());
+        stream._pending.pop_front();
+
+        // the rest waits for the next window update
+        if (msg.size() > stream._send_window) {
+            stream._pending.push_front(buffer_pool::global().copy({ msg.data() + stream._send_window, static_cast<std::ptrdiff_t>(msg.size() - stream._send_window) }));
+            stream._queued.fetch_sub(msg.size() - stream._send_window, std::memory_order_relaxed);
+            stream._queued.fetch_add(stream._pending.front().size(), std::memory_order_relaxed);
+            msg.resize(stream._send_window);
+        }
+
+        stream._send_window -= static_cast<uint32_t>(msg.size());
+        stream._queued.fetch_sub(msg.size(), std::memory_order_relaxed);
+        send(type_data, 0, stream._id, static_cast<uint32_t>(msg.size()), &msg);
+    }
+
+    if (stream._pending.empty() && stream._write_closed && !stream._fin_sent) {
+        stream._fin_sent = true;
+        send(type_window_update, flag_fin, stream._id, 0);
+        if (stream._fin_received) release(stream);
+        else stream.half_close();
+    }
+
+    if (stream._queued.load(std::memory_order_relaxed) <= stream._opts.low_watermark) stream.drained({});
+}
+
+void muxer::release(muxer_stream& stream)
+{
+    auto it = _streams.find(stream._id);
+    if (it == _streams.end()) return;
+
+    if (((stream._id & 1) != 0) != (_role == role_t::initiator)) _inbound--;
+    _count.fetch_sub(1, std::memory_order_relaxed);
+
+    // the stream may be gone with the last handle
+    auto keep = std::move(it->second);
+    _streams.erase(it);
+
+    if (stream._half_closed) {
+        stream._half_closed = false;
+        half_close_timers::global().cancel(stream._half_close_timer);
+    }
+}
+
+// No FIN from the peer within the half-close timeout: reset the stream
+void muxer::expire(muxer_stream& stream)
+{
+    if (!stream._half_closed || !_streams.count(stream._id)) return;
+
+    send(type_window_update, flag_rst, stream._id, 0);
+    stream.fail(asio::error::timed_out);
+    release(stream);
+}
+
+void muxer::shutdown(std::error_code error, uint32_t reason)
+{
+    if (_shut) return;
+    _shut = true;
+
+    if (error != asio::error::eof && _conn->is_open()) send(type_go_away, 0, 0, reason);
+    _conn->close();
+
+    // the streams release this muxer
+    auto streams = std::move(_streams);
+    _streams.clear();
+    _count.store(0, std::memory_order_relaxed);
+    _inbound = 0;
+
+    for (auto& kv : streams) kv.second->fail(error == asio::error::eof ? asio::error::connection_reset : error);
+    _handler = nullptr;
+}
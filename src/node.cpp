@@ -1,51 +1,35 @@
 #include <p2p/node.h>
+#include <p2p/muxer.h>
+#include <p2p/protocols/ping.h>
+#include <multiformats-ext/multistream.h>
 
 using namespace p2p;
 using namespace multiformats;
 
 #include <p2p/transports/tcp.h>
+#include <p2p/transports/uring.h>
+#include <p2p/utils/dial_order.h>
 
-#ifdef _MSC_VER
-#include <SDKDDKVer.h>
-#endif
-
-#define ASIO_STANDALONE 
-#include <asio.hpp>
+#include "io_pool.h"
 using _tcp = asio::ip::tcp;
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <thread>
-#include <deque>
 
 // https://github.com/libp2p/js-libp2p/blob/master/examples/echo/src/libp2p-bundle.js
 // https://github.com/libp2p/js-libp2p/blob/master/src/index.js
 
 using namespace std::placeholders;
 
-class ASIO_Singleton
-{
-public:
-    ASIO_Singleton() : _work(io_service), _loop([this]() { 
-        io_service.run();
-    })
-    { }
-
-    ~ASIO_Singleton() {
-        io_service.stop(); 
-        _loop.join(); 
-    }
-
-    asio::io_service io_service;
-
-private:
-    asio::io_service::work _work;
-    std::thread _loop;
-};
-
-static ASIO_Singleton ASIO;
-
-
 namespace {
+    // the stream multiplexer, negotiated on each connection
+    const std::string mux_protocol = "/yamux/1.0.0";
+    const std::string echo_protocol = "/echo/1.0.0";
+
     const struct node_error_category : std::error_category
     {
         const char* name() const noexcept override { return "p2p::node"; }
@@ -57,6 +41,9 @@ namespace {
             case node_error::no_ipfs_address:
                 return "the provided multiaddress is not an IPFS address";
 
+            case node_error::no_dialable_address:
+                return "the peer has no address supported by the transports";
+
             default:
                 return "(unrecognized error)";
             }
@@ -70,156 +57,206 @@ std::error_code p2p::make_error_code(node_error e)
 }
 
 
-class echo_server : public std::enable_shared_from_this<echo_server>
+//
+// dial_race races the connection attempts to the addresses of a peer (happy eyeballs, RFC 8305):
+//   the next attempt starts after a stagger, or as soon as one fails. The first connection
+//   established wins, the attempts still pending are cancelled.
+//   The dial handlers run on the io threads of the attempts, hence the mutex. A race keeps the
+//   transport and the io threads it uses until its last attempt completed.
+//
+class dial_race : public std::enable_shared_from_this<dial_race>
 {
 public:
-    echo_server()
-        : _socket(ASIO.io_service), _data(1024)
-    { }
+    using handler_t = std::function<void(const std::error_code&, std::shared_ptr<connection>, const multiaddr&)>;
 
-    ~echo_server()
-    { 
-        _socket.close();
-    }
-
-    _tcp::socket& socket() { return _socket; }
+    dial_race(const sp_transport& transport, const sp_io_pool& pool, std::vector<multiaddr> addrs, std::chrono::milliseconds stagger, const handler_t& handler)
+        : _transport(transport), _pool(pool), _addrs(std::move(addrs)), _attempts(_addrs.size()), _stagger(stagger), _handler(handler)
+    { }
 
     void start()
     {
-        _socket.async_read_some(asio::buffer(_data), std::bind(&echo_server::handle_read, shared_from_this(), _1, _2));
+        launch();
     }
 
 private:
-    void handle_read(asio::error_code error, size_t bytes_transferred)
+    struct attempt_t {
+        std::shared_ptr<connection> conn;
+        bool                        finished = false;
+    };
+
+    void launch()
     {
-        //{//DEBUG
-        //    std::cout << "echo_server:handle_read:error:" << error.message() << std::endl;
-        //    std::cout << "                       :bytes:" << bytes_transferred << std::endl;
-        //}
-        if (!error)
-        {
-            asio::async_write(_socket, asio::buffer(_data.data(), bytes_transferred), std::bind(&echo_server::handle_write, shared_from_this(), _1));
-        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_done || _next == _addrs.size()) return;
+        auto index = _next++;
+        lock.unlock();
+
+        auto self(shared_from_this());
+        auto conn = _transport->dial(_addrs[index], [self, this, index](const std::error_code& error, std::shared_ptr<connection> conn) {
+            on_attempt(index, error, conn);
+        });
+
+        lock.lock();
+        // the attempt may have completed already, on its own io thread
+        if (!_attempts[index].finished) _attempts[index].conn = conn;
+        if (_done || index + 1 == _addrs.size()) return;
+
+        auto timer = std::make_shared<asio::steady_timer>(_pool->next(), _stagger);
+        _timers.push_back(timer);
+        lock.unlock();
+
+        timer->async_wait([self, this, index](asio::error_code error) {
+            if (error) return;
+
+            // stop waiting for an attempt still pending, unless a failure started the next one already
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto latest = _next == index + 1;
+            lock.unlock();
+
+            if (latest) launch();
+        });
     }
 
-    void handle_write(asio::error_code error)
+    void on_attempt(size_t index, const std::error_code& error, std::shared_ptr<connection> conn)
     {
-        //{//DEBUG
-        //    std::cout << "echo_server:handle_write:error:" << error.message() << std::endl;
-        //}
+        std::unique_lock<std::mutex> lock(_mutex);
+        _attempts[index].finished = true;
+        _attempts[index].conn.reset();
+
+        if (error) {
+            if (_done) return;
+            if (++_failed < _addrs.size()) {
+                lock.unlock();
+                return launch();
+            }
 
-        if (!error)
-        {
-            _socket.async_read_some(asio::buffer(_data), std::bind(&echo_server::handle_read, shared_from_this(), _1, _2));
+            _done = true;
+            lock.unlock();
+            return _handler(error, nullptr, _addrs[index]);
+        }
+
+        if (_done) {
+            lock.unlock();
+            return conn->close();
+        }
+
+        _done = true;
+        auto losers = std::vector<std::shared_ptr<connection>>{};
+        for (auto& attempt : _attempts) {
+            if (attempt.conn) losers.push_back(std::move(attempt.conn));
         }
+        auto timers = std::move(_timers);
+        lock.unlock();
+
+        for (auto& loser : losers) {
+            loser->close();
+        }
+        // timers are not thread-safe: cancel them from their own io thread
+        for (auto& timer : timers) {
+            asio::post(timer->get_executor(), [timer]() { timer->cancel(); });
+        }
+
+        _handler({}, conn, _addrs[index]);
     }
 
-    _tcp::socket _socket;
-    std::vector<char> _data;
+private:
+    sp_transport                                      _transport;
+    sp_io_pool                                        _pool;
+    std::vector<multiaddr>                            _addrs;
+    std::vector<attempt_t>                            _attempts;
+    std::vector<std::shared_ptr<asio::steady_timer>> _timers;
+    std::chrono::milliseconds                         _stagger;
+    handler_t                                         _handler;
+
+    std::mutex _mutex;
+    size_t     _next = 0;
+    size_t     _failed = 0;
+    bool       _done = false;
 };
 
-class echo_client : public p2p::connection, public std::enable_shared_from_this<echo_client>
+
+//
+// drain closes connections once they sent their queued writes, or at a deadline. It polls the write
+//   queues, on one io thread: a node drains once. The bytes still queued in the connections it had
+//   to close are reported as lost. It keeps the io threads, to finish after its node is gone.
+//
+class drain : public std::enable_shared_from_this<drain>
 {
-    public:
-        echo_client()
-            : _socket(ASIO.io_service)
-        { }
-
-        ~echo_client()
-        {
-            _socket.close();
-        }
-
-        _tcp::socket& socket() { return _socket; }
-
-        void async_connect(_tcp::resolver::iterator endpoint_iterator, const std::function<void(std::error_code)>& handler)
-        {
-            auto self(shared_from_this());
-            asio::async_connect(_socket, endpoint_iterator, [self, handler](std::error_code error, _tcp::resolver::iterator it)
-            {
-                //{//DEBUG
-                //    std::cout << "echo_client:async_connect:error:" << error.message() << std::endl;
-                //    std::cout << "                         :it   :" << it->host_name() << ":" << it->service_name() << std::endl;
-                //}
-                handler(error);
-            });
-        }
-
-        void close()
-        {
-            ASIO.io_service.post([this]() { _socket.close(); });
-        }
-
-        void write(const buffer_t& msg)
-        {
-            auto self(shared_from_this());
-            ASIO.io_service.post([self, this, msg]()
-            {
-                bool write_in_progress = !write_queue.empty();
-                write_queue.push_back(msg);
-                if (!write_in_progress)
-                {
-                    do_write();
-                }
-            });
-        }
-
-        void read(const std::function<void(std::error_code, const buffer_t&)>& handler)
-        {
-            auto self(shared_from_this());
-            _socket.async_read_some(asio::buffer(read_buffer, max_length), [self, this, handler](std::error_code error, std::size_t length)
-            {
-                //{//DEBUG
-                //    std::cout << "echo_client:async_read:error :" << error.message() << std::endl;
-                //    std::cout << "                      :length:" << length << std::endl;
-                //}
-
-                if (error) {
-                    _socket.close();
-                    return handler(error, {});
-                }
-
-                handler({}, buffer_t{ &read_buffer[0], &read_buffer[length] });
-            });
-        }
-
-    private:
-        void do_write()
-        {
-            auto self(shared_from_this());
-            asio::async_write(_socket, asio::buffer(write_queue.front().data(), write_queue.front().size()), [self, this](std::error_code ec, std::size_t /*length*/)
-            {
-                if (!ec)
-                {
-                    write_queue.pop_front();
-                    if (!write_queue.empty())
-                    {
-                        do_write();
-                    }
-                }
-                else
-                {
-                    _socket.close();
-                }
-            });
-        }
-
-    private:
-        _tcp::socket _socket;
-        enum { max_length = 1024 };
-        char read_buffer[max_length];
-        std::deque<buffer_t> write_queue;
+public:
+    using handler_t = std::function<void(size_t)>;
+
+    drain(const sp_io_pool& pool, std::vector<std::shared_ptr<connection>> conns, std::chrono::milliseconds timeout, std::chrono::milliseconds interval, const handler_t& handler)
+        : _pool(pool), _timer(pool->at(0)), _conns(std::move(conns)), _deadline(std::chrono::steady_clock::now() + timeout), _interval(interval), _handler(handler)
+    { }
+
+    void start()
+    {
+        auto self(shared_from_this());
+        asio::post(_timer.get_executor(), [self]() { self->poll(); });
+    }
+
+private:
+    void poll()
+    {
+        auto queued = size_t{ 0 };
+        for (auto& conn : _conns) {
+            if (conn->is_open()) queued += conn->queued_bytes();
+        }
+
+        if (!queued || std::chrono::steady_clock::now() >= _deadline) return finish(queued);
+
+        auto self(shared_from_this());
+        _timer.expires_after(_interval);
+        _timer.async_wait([self](asio::error_code) { self->poll(); });
+    }
+
+    void finish(size_t lost)
+    {
+        // the kernel still sends what the sockets buffered
+        for (auto& conn : _conns) {
+            conn->close();
+        }
+        _conns.clear();
+
+        if (_handler) _handler(lost);
+    }
+
+    sp_io_pool                               _pool;   // first: released last, once the timer is
+    asio::steady_timer                       _timer;
+    std::vector<std::shared_ptr<connection>> _conns;
+    std::chrono::steady_clock::time_point    _deadline;
+    std::chrono::milliseconds                _interval;
+    handler_t                                _handler;
 };
 
 
-class p2p::node::nodeimpl
+//
+// nodeimpl is shared with the handlers of its dials and listeners, which only keep a weak reference:
+//   once the node is gone, they close the connections they get.
+//
+class p2p::node::nodeimpl : public std::enable_shared_from_this<nodeimpl>
 {
 
 public:
-    nodeimpl()
-        : _acceptor(ASIO.io_service), _resolver(ASIO.io_service)
+    nodeimpl(const options& opts, const std::shared_ptr<protocol_table>& table)
+        : _opts(opts), _pool(std::make_shared<io_pool>(pool_options(opts))), _transport(make_transport(_pool, opts)), _resolver(_pool->at(0)),
+          _protocols(std::make_shared<multistream::listener>(table))
     {
         local_endpoints();
+
+        // the streams of a multiplexed connection negotiate their own protocol
+        auto weak = std::weak_ptr<multistream::listener>{ _protocols };
+        _protocols->add(mux_protocol, [weak, opts](std::shared_ptr<connection> conn, const std::string&) {
+            auto protocols = weak.lock();
+            if (!protocols) return conn->close();
+
+            auto mux = std::make_shared<muxer>(conn, muxer::role_t::responder, opts);
+            mux->start([protocols](std::shared_ptr<connection> stream) { protocols->handle(stream); });
+        });
+
+        // until replaced, the node echoes what the peers send
+        auto draining = _draining;
+        _protocols->add(echo_protocol, [draining](std::shared_ptr<connection> conn, const std::string&) { echo(conn, draining); });
     }
 
     ~nodeimpl()
@@ -259,85 +296,355 @@ public:
     }
 
 
-    multiaddr listen(const multiaddr& ma)
+    // Listen on every IP address supported by the transport, each with its own accept loops: a name
+    //   (/dns4, /dns6) is only advertised. Returns the pairs (requested address, bound address), and
+    //   throws with nothing left listening when an address cannot be bound.
+    template <class MultiaddrContainer>
+    std::vector<std::pair<multiaddr, multiaddr>> listen(const MultiaddrContainer& addrs)
     {
-        auto protocol = ma[0].addr() == ip4 ? _tcp::v4() : ma[0].addr() == ip6 ? _tcp::v6() : throw std::invalid_argument("must be IPv4 or IPv6 multiaddr");
-        auto host = ma[0].str();
-        auto port = std::stoi(ma[1].str());
-
-        _acceptor.open(protocol);
-        _acceptor.set_option(_tcp::acceptor::reuse_address(true));
-        _acceptor.bind(_tcp::endpoint(asio::ip::address::from_string(host), port));
-        _acceptor.listen();
-
-        accept_new_connection();
-
-        auto lep = _acceptor.local_endpoint();
-        auto addr = lep.address();
+        // the connections that do not negotiate a protocol get their echo
+        auto weak = std::weak_ptr<nodeimpl>{ shared_from_this() };
+        auto listener = _transport->create_listener([weak](std::shared_ptr<connection> conn) {
+            auto self = weak.lock();
+            if (!self) return conn->close();
+
+            self->track(conn);
+            auto draining = self->_draining;
+            self->_protocols->handle(conn, [draining](std::shared_ptr<connection> conn) { echo(conn, draining); });
+        });
+        _listeners.push_back(listener);
 
-        return { (ma[0].addr() == ip4 ? "/ip4/" : "/ip6/") + lep.address().to_string() + "/tcp/" + std::to_string(lep.port()) };
+        auto bound = std::vector<std::pair<multiaddr, multiaddr>>{};
+        try {
+            for (auto& ma : _transport->filter(addrs)) {
+                if (ma[0].addr() != ip4 && ma[0].addr() != ip6) continue;
+                bound.emplace_back(ma, listener->listen(ma));
+            }
+        }
+        catch (...) {
+            listener->close();
+            _listeners.pop_back();
+            throw;
+        }
+        return bound;
     }
 
     void stop()
     {
-        _acceptor.close();
-        _resolver.cancel();
+        *_draining = true;
+        for (auto& conn : release()) {
+            conn->close();
+        }
     }
 
-    template <class Iterator>
-    void async_connect(const Iterator& current, const Iterator& end, const DialHandler& handler)
+    // Stop accepting and echoing, then close the connections once they sent their queued writes, or after
+    //   the timeout. The handler runs even if the node is destroyed first.
+    void stop(std::chrono::milliseconds timeout, const CloseHandler& handler)
     {
-        auto ma = *current;
-
-        auto host = ma[0].str();
-        auto port = ma[1].str();
-
-        _resolver.async_resolve({ host, port }, [this, current, end, handler](asio::error_code error, _tcp::resolver::iterator it) {
-            //{//DEBUG
-            //    std::cout << "on_async_resolve:error:" << error.message() << std::endl;
-            //    auto copyIt = it;
-            //    while (copyIt != _tcp::resolver::iterator{}) {
-            //        std::cout << "                :it   :" << copyIt->host_name() << ":" << copyIt->service_name() << std::endl;
-            //        copyIt++;
-            //    }
-            //}
-
-            if (error) {
-                auto next = current;
-                next++;
-                if (next == end) return handler(error, nullptr);
-                return async_connect(next, end, handler);
+        *_draining = true;
+        auto conns = release();
+        auto interval = std::max(_opts.io.timer_tick, std::chrono::milliseconds{ 1 });
+        std::make_shared<drain>(_pool, std::move(conns), timeout, interval, handler)->start();
+    }
+
+    // Get the connection to a peer: the live one when there is one, otherwise a new one
+    //   shared by all the dials made to the peer in the meantime
+    void async_connect(const peerinfo& info, const DialHandler& handler)
+    {
+        auto addrs = _transport->filter(info.addrs());
+        if (addrs.empty()) return handler(node_error::no_dialable_address, nullptr);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _peers.find(info.id());
+        if (it != _peers.end()) {
+            auto& peer = it->second;
+            if (!peer.conn) {
+                peer.waiting.push_back(handler);
+                return;
             }
+            if (peer.conn->is_open()) {
+                auto conn = peer.conn;
+                lock.unlock();
+                return handler({}, conn);
+            }
+        }
+        // a race still running for an entry replaced meanwhile (hung up) is told apart by its attempt
+        auto attempt = ++_attempts;
+        _peers.erase(info.id());
+        _peers.emplace(info.id(), peer_t{ nullptr, { handler }, nullptr, attempt, {} });
+
+        auto last_good = _last_good.find(info.id());
+        addrs = order_addresses(addrs, _opts.dial, last_good != _last_good.end() ? &last_good->second : nullptr);
+        lock.unlock();
+
+        auto id = info.id();
+        auto weak = std::weak_ptr<nodeimpl>{ shared_from_this() };
+        auto race = std::make_shared<dial_race>(_transport, _pool, std::move(addrs), _opts.dial.stagger,
+            [weak, id, attempt](const std::error_code& error, std::shared_ptr<connection> conn, const multiaddr& ma) {
+                // the node closed meanwhile: its waiting handlers were told already
+                auto self = weak.lock();
+                if (!self) {
+                    if (conn) conn->close();
+                    return;
+                }
+
+                self->on_dial(id, attempt, error, conn, ma);
+            });
+        race->start();
+    };
+
+    // Open a stream on the connection to a peer, multiplexed, and negotiate the protocol on it
+    void open_stream(const peerinfo& info, const protocol_t& protocol, const DialHandler& handler)
+    {
+        auto id = info.id();
+        auto lazy = _opts.negotiation.lazy;
+        auto weak = std::weak_ptr<nodeimpl>{ shared_from_this() };
+        async_connect(info, [weak, id, protocol, lazy, handler](const std::error_code& error, std::shared_ptr<connection> conn) {
+            if (error) return handler(error, nullptr);
+
+            auto self = weak.lock();
+            if (!self) return handler(std::make_error_code(std::errc::operation_canceled), nullptr);
 
-            auto conn = std::make_shared<echo_client>();
-            conn->async_connect(it, [=](std::error_code error) {
-                return error ? handler(error, {}) : handler({}, conn);
+            self->multiplex(id, conn, [protocol, lazy, handler](const std::error_code& error, std::shared_ptr<muxer> mux) {
+                if (error) return handler(error, nullptr);
+                auto stream = mux->open();
+
+                // the lazy proposal goes with the first write on the stream: no round trip
+                if (lazy) return handler({}, multistream::dialer::select_lazy(stream, protocol));
+
+                multistream::dialer::select(stream, { protocol }, [handler](std::error_code error, std::shared_ptr<connection> conn, const std::string&) {
+                    handler(error, conn);
+                });
             });
         });
-    };
+    }
+
+    // Close the connection to a peer, or abandon the dial in progress
+    void hangup(const peerid& id)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _peers.find(id);
+        if (it == _peers.end()) return;
+
+        auto peer = std::move(it->second);
+        _peers.erase(it);
+        lock.unlock();
+
+        if (peer.conn) peer.conn->close();
+        for (auto& handler : peer.waiting) {
+            handler(std::make_error_code(std::errc::operation_canceled), nullptr);
+        }
+        for (auto& handler : peer.muxing) {
+            handler(std::make_error_code(std::errc::operation_canceled), nullptr);
+        }
+    }
+
+    const sp_transport& transport() const { return _transport; }
+    const sp_io_pool&   pool() const      { return _pool; }
 
 private:
-    void accept_new_connection()
+    using mux_handler_t = std::function<void(const std::error_code&, std::shared_ptr<muxer>)>;
+
+    // Get the multiplexer of the connection to a peer, negotiated with its first stream: one round trip
+    //   for the connection, so that a peer without it fails the streams at once instead of their first
+    //   read. The streams opened meanwhile wait for the answer.
+    void multiplex(const peerid& id, const std::shared_ptr<connection>& conn, const mux_handler_t& handler)
     {
-        auto new_session = std::make_shared<echo_server>();
-        _acceptor.async_accept(new_session->socket(), [this, new_session](asio::error_code error)
-        {
-            //{//DEBUG
-            //    std::cout << "on_async_accept:error :" << error.message() << std::endl;
-            //    std::cout << "               :local :" << new_session->socket().local_endpoint() << std::endl;
-            //    std::cout << "               :remote:" << new_session->socket().remote_endpoint() << std::endl;
-            //}
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _peers.find(id);
+        auto known = it != _peers.end() && it->second.conn == conn;
+        if (known && it->second.mux) {
+            auto mux = it->second.mux;
+            lock.unlock();
+            return handler({}, mux);
+        }
+        if (known) {
+            it->second.muxing.push_back(handler);
+            if (it->second.muxing.size() > 1) return;
+        }
+        lock.unlock();
+
+        auto opts = _opts;
+        auto protocols = _protocols;
+        auto weak = std::weak_ptr<nodeimpl>{ shared_from_this() };
+        multistream::dialer::select(conn, { mux_protocol }, [weak, id, conn, known, handler, opts, protocols](std::error_code error, std::shared_ptr<connection> selected, const std::string&) {
+            auto mux = std::shared_ptr<muxer>{};
+            if (!error) {
+                mux = std::make_shared<muxer>(selected, muxer::role_t::initiator, opts);
+                mux->start([protocols](std::shared_ptr<connection> stream) { protocols->handle(stream); });
+            }
 
-            if (error) return;
+            // hung up or closed meanwhile: the handlers waiting were told already, the connection is closed
+            auto self = weak.lock();
+            if (!known) return handler(error, mux);
+            if (!self) return;
 
-            new_session->start();
-            accept_new_connection();
+            for (auto& waiting : self->on_multiplex(id, conn, mux)) waiting(error, mux);
         });
     }
 
+    // Keep the multiplexer of a connection, if it is still the one of the peer: return the handlers waiting for it
+    std::vector<mux_handler_t> on_multiplex(const peerid& id, const std::shared_ptr<connection>& conn, const std::shared_ptr<muxer>& mux)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _peers.find(id);
+        if (it == _peers.end() || it->second.conn != conn) return {};
+
+        it->second.mux = mux;
+        auto waiting = std::move(it->second.muxing);
+        it->second.muxing.clear();
+        return waiting;
+    }
+
+    void on_dial(const peerid& id, uint64_t attempt, const std::error_code& error, std::shared_ptr<connection> conn, const multiaddr& ma)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _peers.find(id);
+        if (it == _peers.end() || it->second.attempt != attempt) {
+            // hung up while dialing: the handlers were told already, the entry may be another dial's now
+            lock.unlock();
+            if (conn) conn->close();
+            return;
+        }
+
+        auto waiting = std::move(it->second.waiting);
+        it->second.waiting.clear();
+
+        if (error) {
+            _peers.erase(it);
+        }
+        else {
+            it->second.conn = conn;
+            _last_good.erase(id);
+            _last_good.emplace(id, ma);
+        }
+        lock.unlock();
+
+        for (auto& handler : waiting) {
+            handler(error, conn);
+        }
+    }
+
 private:
-    _tcp::acceptor _acceptor;
-    _tcp::resolver _resolver;
+    // Close the listeners and forget the connections: return the open ones.
+    //   The dials in progress are abandoned, their handlers get operation_canceled.
+    std::vector<std::shared_ptr<connection>> release()
+    {
+        for (auto& listener : _listeners) {
+            listener->close();
+        }
+        _listeners.clear();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto peers = std::move(_peers);
+        auto inbound = std::move(_inbound);
+        _peers.clear();
+        _inbound.clear();
+        lock.unlock();
+
+        auto conns = std::vector<std::shared_ptr<connection>>{};
+        for (auto& kv : peers) {
+            if (kv.second.conn && kv.second.conn->is_open()) conns.push_back(kv.second.conn);
+            for (auto& handler : kv.second.waiting) {
+                handler(std::make_error_code(std::errc::operation_canceled), nullptr);
+            }
+            for (auto& handler : kv.second.muxing) {
+                handler(std::make_error_code(std::errc::operation_canceled), nullptr);
+            }
+        }
+        for (auto& weak : inbound) {
+            auto conn = weak.lock();
+            if (conn && conn->is_open()) conns.push_back(conn);
+        }
+        return conns;
+    }
+
+    // Remember an accepted connection, to close it with the node
+    void track(const std::shared_ptr<connection>& conn)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // the closed connections are forgotten each time the list doubled
+        if (_inbound.size() >= 2 * _inbound_live) {
+            _inbound.erase(std::remove_if(_inbound.begin(), _inbound.end(), [](const std::weak_ptr<connection>& weak) { return weak.expired(); }), _inbound.end());
+            _inbound_live = std::max<size_t>(_inbound.size(), 16);
+        }
+        _inbound.push_back(conn);
+    }
+
+    // The io_uring transport runs the connections on its own threads: the node keeps one io thread,
+    //   unpinned, for its timers and name lookups
+    static options::io_t pool_options(const options& opts)
+    {
+        auto io = opts.io;
+#ifdef P2P_HAS_IO_URING
+        if (opts.uring.enabled) {
+            io.threads = 1;
+            io.pin_threads = false;
+        }
+#endif
+        return io;
+    }
+
+    static sp_transport make_transport(const sp_io_pool& pool, const options& opts)
+    {
+#ifdef P2P_HAS_IO_URING
+        if (opts.uring.enabled) return std::make_shared<transports::uring>(opts);
+#endif
+        return std::make_shared<transports::tcp>(pool, opts);
+    }
+
+    // Send back what the peer sends, until the node stops: a draining node reads no more
+    static void echo(std::shared_ptr<connection> conn, std::shared_ptr<const std::atomic<bool>> draining)
+    {
+        if (*draining) return;
+
+        conn->read(connection::borrowed_read_handler_t{ [conn, draining](std::error_code error, const borrowed_buffer& data) {
+            if (error || *draining) return;
+
+            conn->write(data.retain());
+
+            // stop reading while the peer does not read its echo
+            conn->await_drain([conn, draining](std::error_code error) {
+                if (!error) echo(conn, draining);
+            });
+        } });
+    }
+
+private:
+    options                          _opts;
+    sp_io_pool                       _pool;
+    sp_transport                     _transport;
+    _tcp::resolver                   _resolver;
+    std::vector<sp_listener>         _listeners;
+
+    // connection to each peer (null while it is being dialed), the dials waiting for it, its
+    //   multiplexer once a stream was opened, the attempt of the race that fills it, and the streams
+    //   waiting for the multiplexer to be negotiated
+    struct peer_t {
+        std::shared_ptr<connection> conn;
+        std::vector<DialHandler>    waiting;
+        std::shared_ptr<muxer>      mux;
+        uint64_t                    attempt;
+        std::vector<mux_handler_t>  muxing;
+    };
+
+    std::mutex                       _mutex;
+    std::map<peerid, peer_t>         _peers;
+    uint64_t                         _attempts = 0;
+
+    // accepted connections, the expired ones are pruned as the list grows
+    std::vector<std::weak_ptr<connection>> _inbound;
+    size_t                                 _inbound_live = 16;
+
+    // address of the last successful dial to each peer
+    std::map<peerid, multiaddr>      _last_good;
+
+    // protocols mounted on the switch, negotiated on the accepted connections and streams
+    std::shared_ptr<multistream::listener> _protocols;
+
+    // set once the node stops: the echoes read no more
+    std::shared_ptr<std::atomic<bool>>     _draining = std::make_shared<std::atomic<bool>>(false);
 };
 
 node node::create(const peerinfo& info, const peerstore& store)
@@ -362,27 +669,40 @@ node node::create(const peerinfo& info, const peerstore& store)
     return create({}, info, store);
 }
 
-node node::create(const modules_t& modules, const peerinfo& info, const peerstore& store)
+node node::create(const peerinfo& info, const options& opts, const peerstore& store)
+{
+    return create({}, info, store, opts);
+}
+
+node node::create(const modules_t& modules, const peerinfo& info, const peerstore& store, const options& opts)
 {
-    return { modules, info, store };
+    return { modules, info, store, opts };
 }
 
-node::node(const modules_t& /*modules*/, const peerinfo& info, const peerstore& store) :
-    _info(info), _store(store), _switch(info, store), _impl(new nodeimpl)
+node::node(const modules_t& /*modules*/, const peerinfo& info, const peerstore& store, const options& opts) :
+    _info(info), _store(store), _switch(info, store), _impl(std::make_shared<nodeimpl>(opts, _switch.protocols()))
 {
     _started = false;
 
+    // the transport of the node, tcp or io_uring (options::uring)
+    _switch.add(_impl->transport());
+
     // attach stream multiplexers (modules:connection:muxer)
     // attach crypto channels (modules:connection:crypto)
     // attach discovery mechanisms (modules:discovery)
     // dht provided components: peerRouting, contentRouting, dht (modules:dht)
 
     // Mount default protocols
-    //Ping.mount(_switch)
+    protocols::ping::mount(&_switch);
 }
 
 node::~node() = default;
 
+sp_io_pool node::pool() const
+{
+    return _impl->pool();
+}
+
 
 void node::start()
 {
@@ -398,16 +718,24 @@ void node::start()
 
     _switch.start();
 */
-    auto& ma = *(_info.addrs().begin());
-
-    auto newma = _impl->listen(ma);
+    // the bound addresses replace the configured ones (e.g. port 0 becomes the port picked by the system)
+    for (auto& kv : _impl->listen(_info.addrs())) {
+        _info.update(kv.first, kv.second);
+    }
 
-    _info.update(ma, newma);
+    _started = true;
 }
 
 void node::close()
 {
     _impl->stop();
+    _started = false;
+}
+
+void node::close(std::chrono::milliseconds drain, const CloseHandler& handler)
+{
+    _impl->stop(drain, handler);
+    _started = false;
 }
 
 void node::dial(const peerinfo& info, const DialHandler& handler)
@@ -431,7 +759,8 @@ void node::dial(const multiaddr& info, const DialHandler& handler)
 
 void node::dialProtocol(const peerinfo& info, const std::string& protocol, const DialHandler& handler)
 {
-    _impl->async_connect(info.addrs().begin(), info.addrs().end(), std::move(handler));
+    if (protocol.empty()) return _impl->async_connect(info, std::move(handler));
+    _impl->open_stream(info, protocol, handler);
 }
 void node::dialProtocol(const peerid& id, const std::string& protocol, const DialHandler& handler)
 {
@@ -447,9 +776,14 @@ void node::dialProtocol(const multiaddr& info, const std::string& protocol, cons
     return handler(node_error::no_ipfs_address, nullptr);
 }
 
-void node::hangup(const peerinfo& info)
+void node::handle(const protocol_t& protocol, const ProtocolHandler& handler)
 {
+    _switch.handle(protocol, [handler](std::shared_ptr<connection> conn, const protocol_t&) { handler(conn); });
+}
 
+void node::hangup(const peerinfo& info)
+{
+    _impl->hangup(info.id());
 }
 void node::hangup(const peerid& id)
 {
@@ -0,0 +1,364 @@
+#include <p2p/protocols/ping.h>
+#include <p2p/node.h>
+
+#include "io_pool.h"
+#include "timer_service.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+
+using namespace p2p;
+using namespace p2p::protocols;
+
+// https://github.com/libp2p/specs/blob/master/ping/ping.md
+
+const protocol_t ping::Protocol = "/ipfs/ping/1.0.0";
+
+
+namespace {
+    using ping_clock = std::chrono::steady_clock;
+
+    shared_buffer random_payload()
+    {
+        static thread_local std::mt19937 generator{ std::random_device{}() };
+
+        auto payload = buffer_pool::global().allocate(ping::payload_size);
+        payload.resize(ping::payload_size);
+        std::generate(payload.data(), payload.data() + payload.size(), []() { return static_cast<byte>(generator()); });
+        return payload;
+    }
+
+    //
+    // round_trip is a ping in flight: its echo may come back in pieces
+    //
+    class round_trip : public std::enable_shared_from_this<round_trip>
+    {
+    public:
+        round_trip(std::shared_ptr<connection> stream, const ping::handler_t& handler)
+            : _stream(std::move(stream)), _payload(random_payload()), _handler(handler)
+        { }
+
+        void start()
+        {
+            _start = ping_clock::now();
+            _stream->write(_payload);
+            read();
+        }
+
+    private:
+        void read()
+        {
+            auto self(shared_from_this());
+            _stream->read(connection::borrowed_read_handler_t{ [self, this](std::error_code error, const borrowed_buffer& data) {
+                if (error) return _handler(error, {});
+
+                if (_received + data.size() > _payload.size() || std::memcmp(_payload.data() + _received, data.data(), data.size()) != 0) {
+                    _stream->close();
+                    return _handler(std::make_error_code(std::errc::protocol_error), {});
+                }
+
+                _received += data.size();
+                if (_received < _payload.size()) return read();
+
+                _handler({}, std::chrono::duration_cast<ping::rtt_t>(ping_clock::now() - _start));
+            } });
+        }
+
+        std::shared_ptr<connection> _stream;
+        shared_buffer               _payload;
+        ping::handler_t             _handler;
+        ping_clock::time_point      _start;
+        size_t                      _received = 0;
+    };
+}
+
+
+void ping::mount(switchhub* p_switch)
+{
+    p_switch->handle(Protocol, [](std::shared_ptr<connection> stream, const protocol_t&) { answer(stream); });
+}
+
+void ping::unmount(switchhub* p_switch)
+{
+    p_switch->unhandle(Protocol);
+}
+
+void ping::answer(std::shared_ptr<connection> stream)
+{
+    stream->read(connection::borrowed_read_handler_t{ [stream](std::error_code error, const borrowed_buffer& data) {
+        if (error) return stream->close();
+
+        stream->write(data.retain());
+
+        // stop reading while the peer does not read its answers
+        stream->await_drain([stream](std::error_code error) {
+            if (!error) answer(stream);
+        });
+    } });
+}
+
+void ping::once(std::shared_ptr<connection> stream, const handler_t& handler)
+{
+    std::make_shared<round_trip>(std::move(stream), handler)->start();
+}
+
+
+//
+// pingimpl pings its peers in turn on their stream: a ping, then a wait for the interval, and so on.
+//   The timer of a peer is in the wheel of an io thread of the node, armed for the timeout of the ping in
+//   flight, then for the interval. The RTTs and the streams are shared with the caller, hence the mutex.
+//
+class ping::pingimpl : public std::enable_shared_from_this<pingimpl>
+{
+public:
+    pingimpl(const sp_io_pool& pool, std::chrono::milliseconds timeout)
+        : _pool(pool), _timeout(timeout)
+    { }
+
+    void start(const peerid& peer, std::shared_ptr<connection> stream, std::chrono::milliseconds interval, const end_handler_t& handler)
+    {
+        auto session = session_t{ stream, std::make_shared<ticker_t>(_pool->next()), interval, handler };
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto previous = session_t{};
+        auto it = _sessions.find(peer);
+        if (it != _sessions.end()) {
+            previous = std::move(it->second);
+            _sessions.erase(it);
+        }
+        _sessions.emplace(peer, session);
+        lock.unlock();
+
+        if (previous.stream) end(previous);
+        send(peer, session);
+    }
+
+    void stop(const peerid& peer)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _sessions.find(peer);
+        if (it == _sessions.end()) return;
+
+        auto session = std::move(it->second);
+        _sessions.erase(it);
+        lock.unlock();
+
+        end(session);
+    }
+
+    void stop()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto sessions = std::move(_sessions);
+        _sessions.clear();
+        lock.unlock();
+
+        for (auto& kv : sessions) end(kv.second);
+    }
+
+    // A failure outside of a session: the dial of its stream
+    void fail(const peerid& peer)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _failures[peer]++;
+    }
+
+    rtt_histogram rtts(const peerid& peer) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _rtts.find(peer);
+        return it != _rtts.end() ? it->second : rtt_histogram{};
+    }
+
+    size_t failures(const peerid& peer) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _failures.find(peer);
+        return it != _failures.end() ? it->second : 0;
+    }
+
+    std::vector<peerid> ranking() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto medians = std::vector<std::pair<rtt_t, peerid>>{};
+        for (auto& kv : _rtts) medians.emplace_back(kv.second.p50(), kv.first);
+        lock.unlock();
+
+        std::stable_sort(medians.begin(), medians.end(), [](const std::pair<rtt_t, peerid>& a, const std::pair<rtt_t, peerid>& b) { return a.first < b.first; });
+
+        auto peers = std::vector<peerid>{};
+        for (auto& median : medians) peers.push_back(median.second);
+        return peers;
+    }
+
+private:
+    // The timer of a session, used from its io thread only. The session, the ping in flight and the
+    //   tasks posted to that thread hold it until it is unlinked: its callbacks only keep a weak reference.
+    struct ticker_t {
+        explicit ticker_t(asio::io_context& context)
+            : context(context), timers(asio::use_service<timer_service>(context))
+        { }
+
+        asio::io_context&    context;
+        timer_service&       timers;
+        timer_service::timer timer;
+        bool                 in_flight = false;   // a ping waits for its echo, the timer is its timeout
+    };
+
+    struct session_t {
+        std::shared_ptr<connection> stream;
+        std::shared_ptr<ticker_t>   ticker;
+        std::chrono::milliseconds   interval;
+        end_handler_t               handler;
+    };
+
+    // The session of a peer, unless it was stopped or given another stream
+    bool current(const peerid& peer, const std::shared_ptr<connection>& stream, session_t& session) const
+    {
+        auto it = _sessions.find(peer);
+        if (it == _sessions.end() || it->second.stream != stream) return false;
+
+        session = it->second;
+        return true;
+    }
+
+    // Send a ping and arm its timeout, from the io thread of the timer
+    void send(const peerid& peer, const session_t& session)
+    {
+        // the handlers may outlive the ping
+        auto weak = std::weak_ptr<pingimpl>{ shared_from_this() };
+        auto stream = session.stream;
+        auto ticker = session.ticker;
+        auto timeout = _timeout;
+        asio::post(ticker->context, [weak, peer, stream, ticker, timeout]() {
+            auto weak_ticker = std::weak_ptr<ticker_t>{ ticker };
+            ticker->in_flight = true;
+            if (timeout.count()) ticker->timers.schedule(ticker->timer, timeout, [weak, peer, stream, weak_ticker]() {
+                auto ticker = weak_ticker.lock();
+                if (ticker) done(weak, peer, stream, *ticker, std::make_error_code(std::errc::timed_out), {});
+            });
+
+            ping::once(stream, [weak, peer, stream, ticker](const std::error_code& error, rtt_t rtt) {
+                asio::post(ticker->context, [weak, peer, stream, ticker, error, rtt]() { done(weak, peer, stream, *ticker, error, rtt); });
+            });
+        });
+    }
+
+    // The echo or the timeout of the ping in flight, whichever comes first, from the io thread of the timer
+    static void done(const std::weak_ptr<pingimpl>& weak, const peerid& peer, const std::shared_ptr<connection>& stream, ticker_t& ticker, const std::error_code& error, rtt_t rtt)
+    {
+        if (!ticker.in_flight) return;
+        ticker.in_flight = false;
+        ticker.timers.cancel(ticker.timer);
+
+        auto self = weak.lock();
+        if (self) self->on_rtt(peer, stream, error, rtt);
+    }
+
+    // Record the RTT and wait for the interval, or end the session, from the io thread of the timer
+    void on_rtt(const peerid& peer, const std::shared_ptr<connection>& stream, const std::error_code& error, rtt_t rtt)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto session = session_t{};
+        if (!current(peer, stream, session)) return;
+
+        if (error) {
+            _failures[peer]++;
+            _sessions.erase(peer);
+            lock.unlock();
+
+            end(session);
+            if (session.handler) session.handler(error);
+            return;
+        }
+
+        _rtts[peer].record(rtt);
+        lock.unlock();
+
+        // the next ping after the interval, on the same io thread
+        auto weak = std::weak_ptr<pingimpl>{ shared_from_this() };
+        session.ticker->timers.schedule(session.ticker->timer, session.interval, [weak, peer, stream]() {
+            auto self = weak.lock();
+            if (!self) return;
+
+            std::unique_lock<std::mutex> lock(self->_mutex);
+            auto session = session_t{};
+            if (!self->current(peer, stream, session)) return;
+            lock.unlock();
+
+            self->send(peer, session);
+        });
+    }
+
+    static void end(const session_t& session)
+    {
+        auto ticker = session.ticker;
+        asio::post(ticker->context, [ticker]() {
+            ticker->in_flight = false;
+            ticker->timers.cancel(ticker->timer);
+        });
+        session.stream->close();
+    }
+
+    sp_io_pool                      _pool;
+    std::chrono::milliseconds       _timeout;
+    mutable std::mutex              _mutex;
+    std::map<peerid, session_t>     _sessions;
+    std::map<peerid, rtt_histogram> _rtts;
+    std::map<peerid, size_t>        _failures;
+};
+
+
+ping::ping(node& n, std::chrono::milliseconds timeout)
+    : _impl(std::make_shared<pingimpl>(n.pool(), timeout))
+{ }
+
+ping::~ping()
+{
+    _impl->stop();
+}
+
+void ping::start(const peerid& peer, std::shared_ptr<connection> stream, std::chrono::milliseconds interval, const end_handler_t& handler)
+{
+    _impl->start(peer, std::move(stream), interval, handler);
+}
+
+void ping::start(node& n, const peerinfo& peer, std::chrono::milliseconds interval, const end_handler_t& handler)
+{
+    auto weak = std::weak_ptr<pingimpl>{ _impl };
+    auto id = peer.id();
+    n.dialProtocol(peer, Protocol, [weak, id, interval, handler](const std::error_code& error, std::shared_ptr<connection> stream) {
+        auto impl = weak.lock();
+        if (!impl) return;
+
+        if (error) {
+            impl->fail(id);
+            if (handler) handler(error);
+            return;
+        }
+        impl->start(id, stream, interval, handler);
+    });
+}
+
+void ping::stop(const peerid& peer)
+{
+    _impl->stop(peer);
+}
+
+rtt_histogram ping::rtts(const peerid& peer) const
+{
+    return _impl->rtts(peer);
+}
+
+size_t ping::failures(const peerid& peer) const
+{
+    return _impl->failures(peer);
+}
+
+std::vector<peerid> ping::ranking() const
+{
+    return _impl->ranking();
+}
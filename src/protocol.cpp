@@ -0,0 +1,235 @@
+#include <p2p/protocol.h>
+
+#include <algorithm>
+
+using namespace p2p;
+
+
+namespace {
+    inline bool is_wildcard(const std::string& part)
+    {
+        return part == "x" || part == "X" || part == "*";
+    }
+
+    inline bool is_number(const std::string& part)
+    {
+        return !part.empty() && std::all_of(part.begin(), part.end(), [](char c) { return c >= '0' && c <= '9'; });
+    }
+
+    std::vector<std::string> split_version(const std::string& version)
+    {
+        auto parts = std::vector<std::string>{};
+        auto begin = size_t{ 0 };
+        for (;;) {
+            auto end = version.find('.', begin);
+            parts.push_back(version.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+            if (end == std::string::npos) return parts;
+            begin = end + 1;
+        }
+    }
+}
+
+
+protocol_matcher::protocol_matcher(const protocol_t& pattern)
+    : _kind(kind_t::exact), _pattern(pattern), _prefix(pattern), _specificity(pattern.size())
+{
+    auto slash = pattern.rfind('/');
+    auto name = slash == protocol_t::npos ? protocol_t{} : pattern.substr(0, slash + 1);
+    auto last = pattern.substr(name.size());
+
+    // a version with wildcards: "1.x", "2.*.1"
+    auto parts = split_version(last);
+    auto numbers = std::count_if(parts.begin(), parts.end(), is_number);
+    auto wildcards = std::count_if(parts.begin(), parts.end(), is_wildcard);
+    if (numbers && wildcards && numbers + wildcards == static_cast<std::ptrdiff_t>(parts.size())) {
+        _kind = kind_t::version;
+        _prefix = name;
+        for (auto& part : parts) _version.push_back(is_wildcard(part) ? std::string{} : part);
+        _specificity = name.size() + numbers;
+        return;
+    }
+
+    if (!pattern.empty() && pattern.back() == '*') {
+        _kind = kind_t::prefix;
+        _prefix.pop_back();
+        _specificity = _prefix.size();
+    }
+}
+
+bool protocol_matcher::match(const protocol_t& protocol) const
+{
+    switch (_kind) {
+    case kind_t::exact:
+        return protocol == _pattern;
+
+    case kind_t::prefix:
+        return protocol.compare(0, _prefix.size(), _prefix) == 0;
+
+    case kind_t::version:
+        break;
+    }
+
+    if (protocol.size() <= _prefix.size() || protocol.compare(0, _prefix.size(), _prefix) != 0) return false;
+
+    // the numbers of the version, in place
+    auto begin = _prefix.size();
+    for (auto i = size_t{ 0 }; ; i++) {
+        auto end = (std::min)(protocol.find('.', begin), protocol.size());
+        if (end == begin) return false;
+        for (auto k = begin; k < end; k++) {
+            if (protocol[k] < '0' || protocol[k] > '9') return false;
+        }
+
+        if (i >= _version.size()) {
+            if (!_version.back().empty()) return false;
+        }
+        else if (!_version[i].empty() && protocol.compare(begin, end - begin, _version[i]) != 0) return false;
+
+        if (end == protocol.size()) return i + 1 >= _version.size();
+        begin = end + 1;
+    }
+}
+
+
+protocol_id protocol_table::add(const protocol_t& pattern, const handler_t& handler)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto id = intern(pattern);
+    if (!_entries[id].handler) _handled++;
+    _entries[id].handler = handler;
+    if (!handler) _handled--;
+    return id;
+}
+
+void protocol_table::remove(const protocol_t& pattern)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto id = lookup(pattern);
+    if (id == no_protocol || !_entries[id].handler) return;
+
+    _entries[id].handler = nullptr;
+    _handled--;
+}
+
+protocol_id protocol_table::find(const protocol_t& protocol) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return match(protocol);
+}
+
+bool protocol_table::route(const protocol_t& protocol, handler_t& handler) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto id = match(protocol);
+    if (id == no_protocol) return false;
+
+    handler = _entries[id].handler;
+    return true;
+}
+
+bool protocol_table::dispatch(std::shared_ptr<connection> conn, const protocol_t& protocol) const
+{
+    auto handler = handler_t{};
+    if (!route(protocol, handler)) return false;
+
+    handler(std::move(conn), protocol);
+    return true;
+}
+
+std::vector<protocol_t> protocol_table::protocols() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto result = std::vector<protocol_t>{};
+    for (auto& entry : _entries) {
+        if (entry.handler) result.push_back(entry.matcher.pattern());
+    }
+    return result;
+}
+
+size_t protocol_table::size() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _handled;
+}
+
+// FNV-1a
+uint32_t protocol_table::hash(const protocol_t& protocol)
+{
+    auto h = uint32_t{ 2166136261u };
+    for (auto c : protocol) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+protocol_id protocol_table::match(const protocol_t& protocol) const
+{
+    auto id = lookup(protocol);
+    if (id != no_protocol && _entries[id].handler && _entries[id].matcher.kind() == protocol_matcher::kind_t::exact) return id;
+
+    for (auto pattern : _patterns) {
+        auto& entry = _entries[pattern];
+        if (entry.handler && entry.matcher.match(protocol)) return pattern;
+    }
+    return no_protocol;
+}
+
+protocol_id protocol_table::lookup(const protocol_t& protocol) const
+{
+    if (_slots.empty()) return no_protocol;
+
+    auto h = hash(protocol);
+    auto mask = _slots.size() - 1;
+    for (auto i = h & mask; ; i = (i + 1) & mask) {
+        auto& slot = _slots[i];
+        if (slot.id == no_protocol) return no_protocol;
+        if (slot.hash == h && _entries[slot.id].matcher.pattern() == protocol) return slot.id;
+    }
+}
+
+protocol_id protocol_table::intern(const protocol_t& pattern)
+{
+    auto id = lookup(pattern);
+    if (id != no_protocol) return id;
+
+    if (2 * (_entries.size() + 1) > _slots.size()) rehash((std::max)(_slots.size() * 2, size_t{ 16 }));
+
+    id = static_cast<protocol_id>(_entries.size());
+    _entries.push_back({ protocol_matcher{ pattern }, nullptr });
+
+    auto h = hash(pattern);
+    auto mask = _slots.size() - 1;
+    auto i = h & mask;
+    while (_slots[i].id != no_protocol) i = (i + 1) & mask;
+    _slots[i].hash = h;
+    _slots[i].id = id;
+
+    // the patterns are tried in turn, the most specific first
+    auto& matcher = _entries[id].matcher;
+    if (matcher.kind() != protocol_matcher::kind_t::exact) {
+        auto it = std::find_if(_patterns.begin(), _patterns.end(), [&](protocol_id other) {
+            return _entries[other].matcher.specificity() < matcher.specificity();
+        });
+        _patterns.insert(it, id);
+    }
+    return id;
+}
+
+void protocol_table::rehash(size_t capacity)
+{
+    auto slots = std::vector<slot_t>(capacity);
+    auto mask = capacity - 1;
+    for (auto& slot : _slots) {
+        if (slot.id == no_protocol) continue;
+
+        auto i = slot.hash & mask;
+        while (slots[i].id != no_protocol) i = (i + 1) & mask;
+        slots[i] = slot;
+    }
+    _slots = std::move(slots);
+}
@@ -0,0 +1,597 @@
+#include <p2p/secure_channel.h>
+
+#pragma warning( push )
+#pragma warning( disable : 4250 ) // 'class1' : inherits 'class2::member' via dominance
+#include <botan/aead.h>
+#include <botan/auto_rng.h>
+#include <botan/curve25519.h>
+#include <botan/hash.h>
+#include <botan/kdf.h>
+#include <botan/pubkey.h>
+#include <botan/rsa.h>
+#pragma warning ( pop )
+
+#include <algorithm>
+#include <cstring>
+
+using namespace p2p;
+
+// https://github.com/libp2p/specs/blob/master/secio/README.md, with X25519 and HKDF in place of the
+//   P-256 exchange and the key stretching of secio
+
+const protocol_t secure_channel::Protocol = "/secure/1.0.0";
+
+
+namespace {
+
+    const uint8_t version = 1;
+
+    const size_t header_size = 4;
+    const size_t tag_size    = 16;
+    const size_t key_size    = 32;
+    const size_t x25519_size = 32;
+
+    // The nonce of a record: a salt of each direction, then the count of its records
+    const size_t salt_size   = 4;
+    const size_t nonce_size  = 12;
+
+    // The handshake messages are a few hundred bytes
+    const size_t max_handshake_size = 16 * 1024;
+
+    // A record may be as large as the largest pooled block, whatever the record size of this side
+    const size_t max_record_size = buffer_pool::max_block_size;
+
+    // cipher ids on the wire
+    const uint8_t wire_aes_256_gcm       = 1;
+    const uint8_t wire_chacha20_poly1305 = 2;
+
+    const char* const signature_scheme = "EMSA4(SHA-256)";
+    const char* const key_label        = "p2p secure channel keys";
+    const char* const initiator_label  = "p2p secure channel initiator";
+    const char* const responder_label  = "p2p secure channel responder";
+
+    using cipher_t = secure_channel::cipher_t;
+
+    void put32(byte* out, uint32_t value)
+    {
+        out[0] = static_cast<byte>(value >> 24);
+        out[1] = static_cast<byte>(value >> 16);
+        out[2] = static_cast<byte>(value >> 8);
+        out[3] = static_cast<byte>(value);
+    }
+
+    uint32_t get32(const byte* in)
+    {
+        return static_cast<uint32_t>(in[0]) << 24 | static_cast<uint32_t>(in[1]) << 16 | static_cast<uint32_t>(in[2]) << 8 | in[3];
+    }
+
+    uint8_t to_wire(cipher_t cipher)
+    {
+        return cipher == cipher_t::aes_256_gcm ? wire_aes_256_gcm : wire_chacha20_poly1305;
+    }
+
+    bool from_wire(uint8_t id, cipher_t& cipher)
+    {
+        switch (id) {
+        case wire_aes_256_gcm:       cipher = cipher_t::aes_256_gcm; return true;
+        case wire_chacha20_poly1305: cipher = cipher_t::chacha20_poly1305; return true;
+        default:                     return false;
+        }
+    }
+
+    const char* aead_name(cipher_t cipher)
+    {
+        return cipher == cipher_t::aes_256_gcm ? "AES-256/GCM" : "ChaCha20Poly1305";
+    }
+
+    Botan::BigInt to_bigint(const crypto::bigint_t& value)
+    {
+        return Botan::BigInt(value.data(), value.size());
+    }
+
+    Botan::RandomNumberGenerator& random_generator()
+    {
+        static thread_local Botan::AutoSeeded_RNG generator;
+        return generator;
+    }
+
+    // What a side signs: its role, then the digest of both hellos
+    std::vector<uint8_t> signed_part(const char* label, const Botan::secure_vector<uint8_t>& transcript)
+    {
+        auto part = std::vector<uint8_t>(label, label + std::strlen(label));
+        part.insert(part.end(), transcript.begin(), transcript.end());
+        return part;
+    }
+}
+
+
+//
+// cipher_state seals or opens the records of a direction, in place
+//
+struct secure_channel::cipher_state {
+    cipher_state(cipher_t cipher, Botan::Cipher_Dir direction, const uint8_t* key, const uint8_t* salt)
+        : aead(Botan::get_aead(aead_name(cipher), direction)), direction(direction)
+    {
+        if (!aead) throw std::invalid_argument(std::string("unsupported cipher: ") + aead_name(cipher));
+
+        aead->set_key(key, key_size);
+        std::memcpy(nonce, salt, salt_size);
+        granularity = aead->update_granularity();
+    }
+
+    // Seal `size` bytes, followed by room for the tag, or open `size` bytes ending with the tag:
+    //   false when the record was not sealed by the peer. The header is authenticated with the record.
+    bool process(const byte* header, byte* data, size_t size)
+    {
+        for (auto i = size_t{ 0 }; i < 8; i++) nonce[salt_size + i] = static_cast<uint8_t>(sequence >> (56 - 8 * i));
+        sequence++;
+
+        aead->set_associated_data(header, header_size);
+        aead->start(nonce, nonce_size);
+
+        // the whole blocks are processed in place, the last bytes and the tag through a copy
+        auto body = direction == Botan::ENCRYPTION ? size : size - tag_size;
+        auto bulk = body - body % granularity;
+        if (bulk) aead->process(data, bulk);
+
+        // Botan 2 throws Invalid_Authentication_Tag on a tag mismatch, its first versions Integrity_Failure
+        tail.assign(data + bulk, data + size);
+        try {
+            aead->finish(tail);
+        }
+        catch (const Botan::Invalid_Authentication_Tag&) {
+            return false;
+        }
+        catch (const Botan::Integrity_Failure&) {
+            return false;
+        }
+        std::memcpy(data + bulk, tail.data(), tail.size());
+        return true;
+    }
+
+    std::unique_ptr<Botan::AEAD_Mode> aead;
+    Botan::Cipher_Dir                 direction;
+    size_t                            granularity;
+    uint8_t                           nonce[nonce_size];
+    uint64_t                          sequence = 0;
+    Botan::secure_vector<uint8_t>     tail;
+};
+
+
+//
+// handshake_state is what the handshake needs until both sides proved their identity
+//
+struct secure_channel::handshake_state {
+    Botan::Curve25519_PrivateKey  ephemeral{ random_generator() };
+    multiformats::buffer_t        hello;
+    multiformats::buffer_t        peer_hello;
+    std::unique_ptr<peerid>       expected;
+    crypto::rsa_public_key        peer_key;
+    Botan::secure_vector<uint8_t> transcript;
+    std::unique_ptr<cipher_state> seal;
+    std::unique_ptr<cipher_state> open;
+};
+
+
+void secure_channel::dial(std::shared_ptr<p2p::connection> conn, const peerid& local, const peerid& remote, const options& opts, const handler_t& handler)
+{
+    // only a peer with its private key can prove who it is
+    if (local.privkey().empty()) {
+        conn->close();
+        return handler(std::make_error_code(std::errc::invalid_argument), nullptr);
+    }
+
+    auto channel = std::shared_ptr<secure_channel>{ new secure_channel(std::move(conn), role_t::initiator, local, opts) };
+
+    channel->_handshake->expected.reset(new peerid(remote));
+    channel->start(handler);
+}
+
+void secure_channel::accept(std::shared_ptr<p2p::connection> conn, const peerid& local, const options& opts, const handler_t& handler)
+{
+    // only a peer with its private key can prove who it is
+    if (local.privkey().empty()) {
+        conn->close();
+        return handler(std::make_error_code(std::errc::invalid_argument), nullptr);
+    }
+
+    auto channel = std::shared_ptr<secure_channel>{ new secure_channel(std::move(conn), role_t::responder, local, opts) };
+
+    channel->start(handler);
+}
+
+secure_channel::secure_channel(std::shared_ptr<p2p::connection> conn, role_t role, const peerid& local, const options& opts)
+    : _conn(std::move(conn)), _role(role), _opts(opts), _cipher(opts.secure.cipher), _local(new peerid(local)), _handshake(new handshake_state)
+{
+    _record_size = (std::min)((std::max)(opts.secure.record_size, size_t{ buffer_pool::min_block_size }), max_record_size);
+
+    // [version][cipher count][ciphers, the preferred one first][X25519 public key][RSA public key protobuf]
+    auto other = _cipher == cipher_t::aes_256_gcm ? cipher_t::chacha20_poly1305 : cipher_t::aes_256_gcm;
+    auto ephemeral = _handshake->ephemeral.public_value();
+    auto identity = local.pubkey().to_protobuf();
+
+    auto& hello = _handshake->hello;
+    hello = { version, 2, to_wire(_cipher), to_wire(other) };
+    hello.insert(hello.end(), ephemeral.begin(), ephemeral.end());
+    hello.insert(hello.end(), identity.begin(), identity.end());
+}
+
+secure_channel::~secure_channel() = default;
+
+void secure_channel::start(const handler_t& handler)
+{
+    _handler = handler;
+
+    auto self(shared_from_this());
+    _conn->post([self, this]() {
+        send_plain(_handshake->hello);
+        pull();
+    });
+}
+
+
+void secure_channel::write(const multiformats::buffer_t& msg)
+{
+    append(msg.data(), msg.size());
+}
+
+void secure_channel::write(const shared_buffer& msg)
+{
+    append(msg.data(), msg.size());
+}
+
+bool secure_channel::try_write(const shared_buffer& msg)
+{
+    if (queued_bytes() >= _opts.write.high_watermark) return false;
+
+    write(msg);
+    return true;
+}
+
+// Drained once the open record was sealed, then the connection drained
+void secure_channel::await_drain(const drain_handler_t& handler)
+{
+    auto self(shared_from_this());
+    post([self, this, handler]() {
+        flush();
+        _conn->await_drain(handler);
+    });
+}
+
+size_t secure_channel::queued_bytes() const
+{
+    return _unsent.load(std::memory_order_relaxed) + _conn->queued_bytes();
+}
+
+void secure_channel::read(const read_handler_t& handler)
+{
+    read(borrowed_read_handler_t{ [handler](std::error_code error, const borrowed_buffer& data) {
+        handler(error, multiformats::buffer_t{ data.begin(), data.end() });
+    } });
+}
+
+void secure_channel::read(const borrowed_read_handler_t& handler)
+{
+    // posted even when a record is ready: a read never calls its handler from read()
+    auto self(shared_from_this());
+    post([self, this, handler]() {
+        _reading = handler;
+        deliver();
+    });
+}
+
+// Seal what was written, then close the connection
+void secure_channel::close()
+{
+    _closed.store(true, std::memory_order_release);
+
+    auto self(shared_from_this());
+    post([self, this]() {
+        flush();
+
+        std::unique_lock<std::mutex> lock(_write_mutex);
+        _write_closed = true;
+        lock.unlock();
+
+        _conn->close();
+    });
+}
+
+bool secure_channel::is_open() const
+{
+    return !_closed.load(std::memory_order_acquire) && _conn->is_open();
+}
+
+void secure_channel::post(std::function<void()> task)
+{
+    _conn->post(std::move(task));
+}
+
+write_stats secure_channel::stats() const
+{
+    return _conn->stats();
+}
+
+
+// Read from the connection, unless a read is already pending
+void secure_channel::pull()
+{
+    if (_pulling || _error) return;
+    _pulling = true;
+
+    auto self(shared_from_this());
+    _conn->read(connection::borrowed_read_handler_t{ [self, this](std::error_code error, const borrowed_buffer& data) {
+        _pulling = false;
+        if (error) return fail(error);
+
+        on_read(data);
+    } });
+}
+
+// Split the bytes received into records: a record may span several reads
+void secure_channel::on_read(const borrowed_buffer& data)
+{
+    auto next = data.begin();
+    auto left = data.size();
+
+    while (left && !_error) {
+        if (!_in_body) {
+            auto count = (std::min)(header_size - _header_size, left);
+            std::memcpy(_header + _header_size, next, count);
+            _header_size += count;
+            next += count;
+            left -= count;
+            if (_header_size < header_size) break;
+            _header_size = 0;
+
+            _in_length = get32(_header);
+            if (_open ? _in_length < tag_size || _in_length > max_record_size - header_size : _in_length > max_handshake_size)
+                return fail(std::make_error_code(std::errc::message_size));
+
+            _in = buffer_pool::global().allocate(_in_length);
+            _in.resize(0);
+            _in_body = true;
+        }
+
+        auto count = (std::min)(_in_length - _in.size(), left);
+        if (count) std::memcpy(_in.data() + _in.size(), next, count);
+        _in.resize(_in.size() + count);
+        next += count;
+        left -= count;
+        if (_in.size() < _in_length) break;
+        _in_body = false;
+
+        auto record = std::move(_in);
+        _in = shared_buffer{};
+        on_record(record);
+    }
+
+    if (_error) return;
+    if (_handshake) return pull();
+    deliver();
+}
+
+void secure_channel::on_record(shared_buffer& record)
+{
+    if (_handshake) {
+        try {
+            if (_handshake->peer_hello.empty()) on_hello(record);
+            else on_proof(record);
+        }
+        catch (const std::exception&) {
+            fail(std::make_error_code(std::errc::protocol_error));
+        }
+        return;
+    }
+
+    if (!_open->process(_header, record.data(), record.size())) return fail(std::make_error_code(std::errc::bad_message));
+
+    record.resize(record.size() - tag_size);
+    if (record.size()) _inbox.push_back(std::move(record));
+}
+
+// The hello of the peer: take the cipher, derive the keys and prove who this side is
+void secure_channel::on_hello(const shared_buffer& hello)
+{
+    auto& handshake = *_handshake;
+    auto data = hello.data();
+    auto size = hello.size();
+
+    if (size < 2 || data[0] != version || size < 2 + data[1] + x25519_size + 1) return fail(std::make_error_code(std::errc::protocol_error));
+    handshake.peer_hello.assign(data, data + size);
+
+    // the first cipher of the dialer the listener supports
+    auto& proposal = _role == role_t::initiator ? handshake.hello : handshake.peer_hello;
+    auto& supported = _role == role_t::initiator ? handshake.peer_hello : handshake.hello;
+    auto found = false;
+    for (auto i = size_t{ 0 }; i < proposal[1] && !found; i++) {
+        auto candidate = cipher_t{};
+        found = from_wire(proposal[2 + i], candidate) && std::find(supported.begin() + 2, supported.begin() + 2 + supported[1], proposal[2 + i]) != supported.begin() + 2 + supported[1];
+        if (found) _cipher = candidate;
+    }
+    if (!found) return fail(std::make_error_code(std::errc::protocol_error));
+
+    auto ephemeral = data + 2 + data[1];
+    auto identity = ephemeral + x25519_size;
+    handshake.peer_key = crypto::rsa_public_key::from_protobuf({ identity, static_cast<std::ptrdiff_t>(data + size - identity) });
+    _remote.reset(new peerid(handshake.peer_key));
+    if (handshake.expected && *_remote != *handshake.expected) return fail(std::make_error_code(std::errc::permission_denied));
+
+    Botan::PK_Key_Agreement agreement(handshake.ephemeral, random_generator(), "Raw");
+    auto secret = agreement.derive_key(x25519_size, ephemeral, x25519_size).bits_of();
+    if (std::all_of(secret.begin(), secret.end(), [](uint8_t b) { return b == 0; })) return fail(std::make_error_code(std::errc::protocol_error));
+
+    // the digest of both hellos, the dialer's first, binds the keys and the proofs to this handshake
+    auto& first = _role == role_t::initiator ? handshake.hello : handshake.peer_hello;
+    auto& second = _role == role_t::initiator ? handshake.peer_hello : handshake.hello;
+    auto hash = Botan::HashFunction::create_or_throw("SHA-256");
+    hash->update(first.data(), first.size());
+    hash->update(second.data(), second.size());
+    handshake.transcript = hash->final();
+
+    // [dialer key][listener key][dialer salt][listener salt]
+    auto kdf = Botan::KDF::create_or_throw("HKDF(SHA-256)");
+    auto keys = kdf->derive_key(2 * (key_size + salt_size), secret.data(), secret.size(), handshake.transcript.data(), handshake.transcript.size(),
+        reinterpret_cast<const uint8_t*>(key_label), std::strlen(key_label));
+
+    auto initiator = _role == role_t::initiator;
+    auto mine = initiator ? 0 : 1;
+    auto theirs = 1 - mine;
+    handshake.seal.reset(new cipher_state(_cipher, Botan::ENCRYPTION, keys.data() + mine * key_size, keys.data() + 2 * key_size + mine * salt_size));
+    handshake.open.reset(new cipher_state(_cipher, Botan::DECRYPTION, keys.data() + theirs * key_size, keys.data() + 2 * key_size + theirs * salt_size));
+
+    auto key = _local->privkey();
+    Botan::RSA_PrivateKey signing_key(to_bigint(key.p), to_bigint(key.q), to_bigint(key.e), to_bigint(key.d), to_bigint(key.n));
+    Botan::PK_Signer signer(signing_key, random_generator(), signature_scheme);
+    send_plain(signer.sign_message(signed_part(initiator ? initiator_label : responder_label, handshake.transcript), random_generator()));
+}
+
+// The proof of the peer: its signature of both hellos, with the key of its hello
+void secure_channel::on_proof(const shared_buffer& proof)
+{
+    auto& handshake = *_handshake;
+    auto signed_by_peer = signed_part(_role == role_t::initiator ? responder_label : initiator_label, handshake.transcript);
+
+    Botan::RSA_PublicKey verifying_key(to_bigint(handshake.peer_key.n), to_bigint(handshake.peer_key.e));
+    Botan::PK_Verifier verifier(verifying_key, signature_scheme);
+    if (!verifier.verify_message(signed_by_peer.data(), signed_by_peer.size(), proof.data(), proof.size()))
+        return fail(std::make_error_code(std::errc::permission_denied));
+
+    established();
+}
+
+void secure_channel::established()
+{
+    std::unique_lock<std::mutex> lock(_write_mutex);
+    _seal = std::move(_handshake->seal);
+    lock.unlock();
+
+    _open = std::move(_handshake->open);
+    _handshake.reset();
+
+    auto handler = std::move(_handler);
+    _handler = nullptr;
+    handler({}, shared_from_this());
+}
+
+// Give the next record to the pending read, or read more
+void secure_channel::deliver()
+{
+    if (!_reading) return;
+
+    if (_inbox.empty()) {
+        if (!_error) return pull();
+
+        auto handler = std::move(_reading);
+        _reading = nullptr;
+        return handler(_error, {});
+    }
+
+    auto msg = std::move(_inbox.front());
+    _inbox.pop_front();
+
+    auto handler = std::move(_reading);
+    _reading = nullptr;
+    handler({}, borrowed_buffer{ msg, msg.size() });
+}
+
+// The connection failed, or the peer did not follow the protocol: the records opened are still read,
+//   then the error
+void secure_channel::fail(std::error_code error)
+{
+    if (_error) return;
+    _error = error;
+    _closed.store(true, std::memory_order_release);
+    _in = shared_buffer{};
+
+    std::unique_lock<std::mutex> lock(_write_mutex);
+    _write_closed = true;
+    _record = shared_buffer{};
+    _sealed.clear();
+    _unsent.store(0, std::memory_order_relaxed);
+    lock.unlock();
+
+    _conn->close();
+
+    if (_handshake) {
+        _handshake.reset();
+        auto handler = std::move(_handler);
+        _handler = nullptr;
+        return handler(error, nullptr);
+    }
+    deliver();
+}
+
+
+// Copy the bytes into the open record, seal it each time it is full: the last one is sealed after
+//   the current io task, with what was written meanwhile
+void secure_channel::append(const byte* data, size_t size)
+{
+    if (!size) return;
+
+    std::unique_lock<std::mutex> lock(_write_mutex);
+    if (_write_closed || !_seal) return;
+    _unsent.fetch_add(size, std::memory_order_relaxed);
+
+    auto capacity = _record_size - tag_size;
+    while (size) {
+        if (!_record) {
+            _record = buffer_pool::global().allocate(_record_size);
+            _record.resize(header_size);
+        }
+
+        auto count = (std::min)(capacity - _record.size(), size);
+        std::memcpy(_record.data() + _record.size(), data, count);
+        _record.resize(_record.size() + count);
+        data += count;
+        size -= count;
+
+        if (_record.size() == capacity) seal();
+    }
+
+    if (_flush_posted) return;
+    _flush_posted = true;
+    lock.unlock();
+
+    auto self(shared_from_this());
+    post([self]() { self->flush(); });
+}
+
+// Seal the open record in place, under the write mutex
+void secure_channel::seal()
+{
+    auto size = _record.size() - header_size;
+    put32(_record.data(), static_cast<uint32_t>(size + tag_size));
+    _seal->process(_record.data(), _record.data() + header_size, size);
+    _record.resize(header_size + size + tag_size);
+
+    _sealed.push_back(std::move(_record));
+    _record = shared_buffer{};
+}
+
+// Seal the open record, then send the records in the order of their nonces: from the io thread only,
+//   a connection does not order the writes of different threads
+void secure_channel::flush()
+{
+    std::unique_lock<std::mutex> lock(_write_mutex);
+    _flush_posted = false;
+
+    if (_record && !_write_closed) seal();
+    auto sealed = std::move(_sealed);
+    _sealed.clear();
+    _unsent.store(0, std::memory_order_relaxed);
+    lock.unlock();
+
+    for (auto& record : sealed) _conn->write(record);
+}
+
+// A handshake message, in a record of its own
+void secure_channel::send_plain(const multiformats::buffer_t& msg)
+{
+    auto frame = buffer_pool::global().allocate(header_size + msg.size());
+    put32(frame.data(), static_cast<uint32_t>(msg.size()));
+    std::memcpy(frame.data() + header_size, msg.data(), msg.size());
+    frame.resize(header_size + msg.size());
+
+    _conn->write(frame);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <p2p/options.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+namespace p2p {
+
+#ifdef _WIN32
+    using native_socket_t = SOCKET;
+#else
+    using native_socket_t = int;
+#endif
+
+    namespace details {
+        // Best effort: an option refused by the system keeps its default
+        template <class T>
+        inline void set_option(native_socket_t socket, int level, int name, T value)
+        {
+            ::setsockopt(socket, level, name, reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+    }
+
+    // Set the buffer sizes of a socket. Set on a listening socket, they are inherited by the accepted
+    //   sockets; they must be set before connecting or listening to size the TCP window scaling.
+    inline void set_buffer_sizes(native_socket_t socket, const options::socket_t& opts)
+    {
+        if (opts.send_buffer > 0)    details::set_option(socket, SOL_SOCKET, SO_SNDBUF, opts.send_buffer);
+        if (opts.receive_buffer > 0) details::set_option(socket, SOL_SOCKET, SO_RCVBUF, opts.receive_buffer);
+    }
+
+    // Leave the delayed ACK mode again: Linux only honours TCP_QUICKACK for a while
+    inline void set_quick_ack(native_socket_t socket)
+    {
+#ifdef TCP_QUICKACK
+        details::set_option(socket, IPPROTO_TCP, TCP_QUICKACK, 1);
+#else
+        (void)socket;
+#endif
+    }
+
+    // Apply all the options to a dialed or accepted TCP socket, the ones the system does not know are skipped
+    inline void set_socket_options(native_socket_t socket, const options::socket_t& opts)
+    {
+        set_buffer_sizes(socket, opts);
+
+        details::set_option(socket, IPPROTO_TCP, TCP_NODELAY, opts.no_delay ? 1 : 0);
+
+        if (opts.quick_ack) set_quick_ack(socket);
+
+#ifdef SO_BUSY_POLL
+        if (opts.busy_poll > 0) details::set_option(socket, SOL_SOCKET, SO_BUSY_POLL, opts.busy_poll);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+        if (opts.notsent_lowat > 0) details::set_option(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts.notsent_lowat);
+#endif
+
+        if (opts.keepalive.enabled) {
+            details::set_option(socket, SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+            details::set_option(socket, IPPROTO_TCP, TCP_KEEPIDLE, static_cast<int>(opts.keepalive.idle.count()));
+#elif defined(TCP_KEEPALIVE)
+            details::set_option(socket, IPPROTO_TCP, TCP_KEEPALIVE, static_cast<int>(opts.keepalive.idle.count()));
+#endif
+#ifdef TCP_KEEPINTVL
+            details::set_option(socket, IPPROTO_TCP, TCP_KEEPINTVL, static_cast<int>(opts.keepalive.interval.count()));
+#endif
+#ifdef TCP_KEEPCNT
+            details::set_option(socket, IPPROTO_TCP, TCP_KEEPCNT, opts.keepalive.probes);
+#endif
+        }
+    }
+
+}
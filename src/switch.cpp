@@ -31,6 +31,21 @@ void switchhub::add(sp_transport transport)
     _transports.insert({ transport->id() , transport });
 }
 
+protocol_id switchhub::handle(const protocol_t& protocol, const handler_t& handler)
+{
+    return _protocols->add(protocol, handler);
+}
+
+void switchhub::unhandle(const protocol_t& protocol)
+{
+    _protocols->remove(protocol);
+}
+
+bool switchhub::dispatch(std::shared_ptr<connection> conn, const protocol_t& protocol) const
+{
+    return _protocols->dispatch(std::move(conn), protocol);
+}
+
 //void switchhub::dial(const key_t& key, const peerinfo& pi)
 //{
 //
@@ -1,44 +1,247 @@
 #include <p2p/transports/tcp.h>
 
-#ifdef _MSC_VER
-#include <SDKDDKVer.h>
-#endif
-
-#define ASIO_STANDALONE 
-#include <asio.hpp>
+#include "dns_cache.h"
+#include "io_pool.h"
+#include "socket_options.h"
+#include "tcp_connection.h"
 
 using namespace p2p;
+using namespace p2p::transports;
 using namespace multiformats;
 
-using _tcp = asio::ip::tcp;
+#ifdef SO_REUSEPORT
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+
+namespace {
+
+    //
+    // tcp_listener accepts connections on the io threads of the pool, and gives them to its handler
+    //   on their own io thread. The pending accepts keep it alive until it is closed, and it keeps the pool.
+    //
+    class tcp_listener : public listener, public std::enable_shared_from_this<tcp_listener>
+    {
+    public:
+        tcp_listener(const sp_io_pool& pool, const options& opts, const handler_t& handler)
+            : _pool(pool), _opts(opts), _handler(handler)
+        { }
+
+        multiaddr listen(const multiaddr& ma)
+        {
+            auto protocol = ma[0].addr() == ip4 ? _tcp::v4() : ma[0].addr() == ip6 ? _tcp::v6() : throw std::invalid_argument("must be IPv4 or IPv6 multiaddr");
+            auto host = ma[0].str();
+            auto port = std::stoi(ma[1].str());
+
+            auto lep = _tcp::endpoint(asio::ip::address::from_string(host), port);
+
+#ifdef SO_REUSEPORT
+            // one acceptor per io thread, the kernel balances the connections between them
+            auto sharded = _opts.listen.reuse_port && _pool->size() > 1;
+#else
+            auto sharded = false;
+#endif
+            auto count = sharded ? _pool->size() : 1;
+
+            for (auto i = size_t{ 0 }; i < count; i++) {
+                auto acceptor = std::make_shared<_tcp::acceptor>(_pool->at(i));
+                acceptor->open(protocol);
+                acceptor->set_option(_tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+                if (sharded) acceptor->set_option(reuse_port(true));
+#endif
+                // inherited by the accepted sockets
+                set_buffer_sizes(acceptor->native_handle(), _opts.socket);
+                acceptor->bind(lep);
+                acceptor->listen();
+
+                // when port 0 was requested, the next shards bind to the one picked for the first
+                lep = acceptor->local_endpoint();
+
+                _acceptors.push_back(std::move(acceptor));
+            }
+
+            // the acceptor of shard i runs on the io thread i
+            auto first = _acceptors.size() - count;
+            for (auto i = first; i < _acceptors.size(); i++) {
+                for (auto n = size_t{ 0 }; n < std::max<size_t>(_opts.listen.pending_accepts, 1); n++) {
+                    accept_new_connection(_acceptors[i], sharded ? i - first : unsharded);
+                }
+            }
+
+            return { (ma[0].addr() == ip4 ? "/ip4/" : "/ip6/") + lep.address().to_string() + "/tcp/" + std::to_string(lep.port()) };
+        }
+
+        void close()
+        {
+            // acceptors are not thread-safe: close them from their own io thread
+            for (auto& acceptor : _acceptors) {
+                asio::post(acceptor->get_executor(), [acceptor]() { acceptor->close(); });
+            }
+        }
+
+    private:
+        // The shard of the acceptors that spread their connections over the pool
+        static const size_t unsharded = static_cast<size_t>(-1);
+
+        // A sharded acceptor keeps its connections on its own io thread, otherwise they are spread over the pool
+        void accept_new_connection(const std::shared_ptr<_tcp::acceptor>& acceptor, size_t shard)
+        {
+            auto& context = shard != unsharded ? _pool->at(shard) : _pool->next();
+
+            auto self(shared_from_this());
+            auto conn = std::make_shared<tcp_connection>(_pool, context, _opts);
+            acceptor->async_accept(conn->socket(), [self, this, acceptor, shard, conn](asio::error_code error)
+            {
+                //{//DEBUG
+                //    std::cout << "on_async_accept:error :" << error.message() << std::endl;
+                //    std::cout << "               :local :" << conn->socket().local_endpoint() << std::endl;
+                //    std::cout << "               :remote:" << conn->socket().remote_endpoint() << std::endl;
+                //}
+
+                if (error) return retry_accept(acceptor, shard);
+                conn->configure();
 
+                // the connection runs on its own io thread
+                auto handler = _handler;
+                asio::post(conn->socket().get_executor(), [handler, conn]() {
+                    conn->touch();
+                    if (handler) handler(conn);
+                });
+                accept_new_connection(acceptor, shard);
+            });
+        }
 
-std::unique_ptr<connection> p2p::transports::tcp::dial(const multiaddr& ma)
+        // An accept failed: stop once the acceptor was closed, otherwise accept again after a delay,
+        //   to leave the system the time to get back the resources it ran out of
+        void retry_accept(const std::shared_ptr<_tcp::acceptor>& acceptor, size_t shard)
+        {
+            if (!acceptor->is_open()) return;
+
+            auto self(shared_from_this());
+            auto timer = std::make_shared<asio::steady_timer>(acceptor->get_executor(), _opts.listen.accept_retry);
+            timer->async_wait([self, this, acceptor, shard, timer](asio::error_code) {
+                accept_new_connection(acceptor, shard);
+            });
+        }
+
+    private:
+        sp_io_pool _pool;
+        options    _opts;
+        handler_t  _handler;
+        std::vector<std::shared_ptr<_tcp::acceptor>> _acceptors;
+    };
+
+
+    // Connect from the io thread of the connection, where close() runs too
+    template <class Endpoints>
+    void connect(const std::shared_ptr<tcp_connection>& conn, const Endpoints& endpoints, const transport::dial_handler_t& handler)
+    {
+        asio::post(conn->socket().get_executor(), [conn, endpoints, handler]() {
+            if (!conn->is_open()) return handler(asio::error::operation_aborted, nullptr);
+
+            conn->async_connect(endpoints, [conn, handler](std::error_code error) {
+                return error ? handler(error, nullptr) : handler({}, conn);
+            });
+        });
+    }
+
+    // Bound a dial, resolution included, by a timeout: the handler is called once, by the dial or by its
+    //   timer, both on the io thread of the connection
+    transport::dial_handler_t with_timeout(const std::shared_ptr<tcp_connection>& conn, std::chrono::milliseconds timeout, const transport::dial_handler_t& handler)
+    {
+        if (!timeout.count()) return handler;
+
+        auto pending = std::make_shared<bool>(true);
+        std::weak_ptr<tcp_connection> weak = conn;
+        conn->start_dial_timer(timeout, [weak, pending, handler]() {
+            if (!*pending) return;
+            *pending = false;
+
+            // a connection closed by its owner was cancelled
+            auto conn = weak.lock();
+            auto error = conn && conn->is_open() ? asio::error::timed_out : asio::error::operation_aborted;
+            if (conn) conn->close();
+            handler(error, nullptr);
+        });
+
+        return [conn, pending, handler](const std::error_code& error, const std::shared_ptr<connection>& result) {
+            if (!*pending) return;
+            *pending = false;
+
+            conn->cancel_dial_timer();
+            handler(error, result);
+        };
+    }
+}
+
+
+p2p::transports::tcp::tcp(const options& opts)
+    : tcp(std::make_shared<io_pool>(opts.io), opts)
+{ }
+
+p2p::transports::tcp::tcp(const std::shared_ptr<io_pool>& pool, const options& opts)
+    : _pool(pool), _opts(opts), _dns(std::make_shared<dns_cache>(pool, opts.dial.resolve_ttl))
+{ }
+
+std::shared_ptr<connection> p2p::transports::tcp::dial(const multiaddr& ma, const dial_handler_t& on_dial)
 {
+    auto protocol = ma[0].addr();
     auto host = ma[0].str();
     auto port = ma[1].str();
 
-    asio::io_service aios;
+    auto conn = std::make_shared<tcp_connection>(_pool, _pool->next(), _opts);
+    auto handler = with_timeout(conn, _opts.timeout.dial, on_dial);
+
+    if (protocol == ip4 || protocol == ip6) {
+        // a literal address needs no lookup
+        auto error = asio::error_code{};
+        auto address = asio::ip::make_address(host, error);
+        if (error) {
+            asio::post(conn->socket().get_executor(), [handler, error]() { handler(error, nullptr); });
+            return conn;
+        }
 
-    _tcp::resolver resolver{ aios };
-    auto endpoint = resolver.resolve(_tcp::resolver::query(ma[0].str(), ma[1].str()));
+        connect(conn, _tcp::endpoint(address, static_cast<unsigned short>(std::stoi(port))), handler);
+        return conn;
+    }
 
-    _tcp::socket socket(aios);
+    _dns->resolve(protocol == dns6 ? _tcp::v6() : _tcp::v4(), host, port, [conn, handler](const std::error_code& error, const dns_cache::results_t& endpoints) {
+        //{//DEBUG
+        //    std::cout << "on_async_resolve:error:" << error.message() << std::endl;
+        //    for (auto& entry : endpoints) {
+        //        std::cout << "                :ep   :" << entry.endpoint() << std::endl;
+        //    }
+        //}
 
-    asio::connect(socket, endpoint);
+        if (error) {
+            return asio::post(conn->socket().get_executor(), [handler, error]() { handler(error, nullptr); });
+        }
+        connect(conn, endpoints, handler);
+    });
 
-    return nullptr;
+    return conn;
 }
 
-listener p2p::transports::tcp::create_listener(std::function<void(const connection&)> handler)
+sp_listener p2p::transports::tcp::create_listener(const listener::handler_t& handler)
 {
-    return listener::create(handler);
+    return std::make_shared<tcp_listener>(_pool, _opts, handler);
 }
 
 bool p2p::transports::tcp::match(const multiformats::multiaddr& addr) const
 {
     if (addr.has(p2p_circuit)) return false;
-    return is_tcp(addr.decapsulate(ipfs));
+
+    auto ma = addr.decapsulate(ipfs);
+    if (is_tcp(ma)) return true;
+
+    // is_tcp only knows the IP addresses
+    return (ma.has(dns4) || ma.has(dns6)) && ma.has(multiformats::tcp);
+}
+
+resolve_stats p2p::transports::tcp::dns_stats() const
+{
+    return _dns->stats();
 }
 
 //std::vector<multiaddr> p2p::transports::tcp::filter(const std::initializer_list<multiformats::multiaddr>& addresses)
@@ -0,0 +1,552 @@
+#pragma once
+
+#include <p2p/connection.h>
+#include <p2p/options.h>
+#include <p2p/utils/adaptive_size.h>
+
+#include "io_pool.h"
+#include "socket_options.h"
+#include "timer_service.h"
+#include "write_counters.h"
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace p2p {
+namespace transports {
+
+    using _tcp = asio::ip::tcp;
+
+
+    //
+    // The receive buffer of a connection, sized after the traffic by an adaptive_size.
+    //   A read after one that emptied the socket may wait long for the peer: it only takes a min_buffer
+    //   block meanwhile. When that block fills up, its bytes move to a block of the adaptive size
+    //   (extend) and the rest is read without waiting, so an idle connection never holds more.
+    //
+    class receive_buffer
+    {
+    public:
+        receive_buffer(const options::read_t& opts)
+            : _size(opts.min_buffer, opts.initial_buffer, opts.max_buffer), _idle_after(opts.idle_after)
+        { }
+
+        // Get the buffer of the next read: a new one while a view or a handle holds the current one, or when the size changed
+        asio::mutable_buffer prepare()
+        {
+            auto size = _drained ? _size.min() : _size.next();
+            if (!_buffer.unique() || _buffer.capacity() < size || _buffer.capacity() >= 2 * size)
+                _buffer = buffer_pool::global().allocate(size);
+
+            _requested = size;
+            _started = std::chrono::steady_clock::now();
+            return asio::buffer(_buffer.data(), size);
+        }
+
+        // Account for a completed read: false when it filled a small block, the socket may hold more
+        //   to read into extend() before complete()
+        bool commit(size_t length)
+        {
+            _buffer.resize(length);
+            _idle = std::chrono::steady_clock::now() - _started > _idle_after;
+            if (_drained && length == _requested && _size.next() > _requested) return false;
+
+            complete(0);
+            return true;
+        }
+
+        // Move the bytes of a filled small block to a block of the adaptive size: the room left in it
+        asio::mutable_buffer extend()
+        {
+            auto grown = buffer_pool::global().allocate(_size.next());
+            std::memcpy(grown.data(), _buffer.data(), _buffer.size());
+            grown.resize(_buffer.size());
+            _buffer = grown;
+
+            _requested = _size.next();
+            return asio::buffer(_buffer.data() + _buffer.size(), _requested - _buffer.size());
+        }
+
+        // Account for the bytes read into extend()
+        void complete(size_t length)
+        {
+            _buffer.resize(_buffer.size() + length);
+            _size.record(_buffer.size(), _idle);
+            _drained = _buffer.size() < _requested;
+        }
+
+        inline const shared_buffer& buffer() const { return _buffer; }
+
+    private:
+        adaptive_size                         _size;
+        std::chrono::steady_clock::duration   _idle_after;
+        std::chrono::steady_clock::time_point _started;
+        shared_buffer                         _buffer;
+        size_t                                _requested = 0;
+        bool                                  _drained = false;
+        bool                                  _idle = false;
+    };
+
+
+    //
+    // tcp_connection is a connection over a TCP socket, bound to one io thread of the pool.
+    //   It shares the ownership of the pool: it stays usable after its transport is gone.
+    //   Its timeouts are timers of the wheel of its io thread: re-arming them on traffic is cheap.
+    //
+    class tcp_connection : public p2p::connection, public std::enable_shared_from_this<tcp_connection>
+    {
+    public:
+        tcp_connection(const sp_io_pool& pool, asio::io_context& context, const options& opts)
+            : _pool(pool), _socket(context), _read_buffer(opts.read), _opts(opts.write), _socket_opts(opts.socket),
+              _timeouts(opts.timeout), _timers(asio::use_service<timer_service>(context))
+        {
+            _gather.reserve(_opts.max_gather_buffers);
+        }
+
+        ~tcp_connection()
+        {
+            _socket.close();
+
+            // the wheel is only touched from the io thread: the timers stay linked until unlinked there
+            if (_deadlines) {
+                auto& timers = _timers;
+                auto deadlines = std::move(_deadlines);
+                asio::post(_socket.get_executor(), [&timers, deadlines]() { deadlines->cancel(timers); });
+            }
+        }
+
+        _tcp::socket& socket() { return _socket; }
+
+        // Apply options::socket, once connected or accepted
+        void configure()
+        {
+            set_socket_options(_socket.native_handle(), _socket_opts);
+        }
+
+        void async_connect(const _tcp::resolver::results_type& endpoints, const std::function<void(std::error_code)>& handler)
+        {
+            // each endpoint tried gets a new socket: configured once connected
+            auto self(shared_from_this());
+            asio::async_connect(_socket, endpoints, [self, handler](std::error_code error, const _tcp::endpoint& /*endpoint*/)
+            {
+                //{//DEBUG
+                //    std::cout << "tcp_connection:async_connect:error:" << error.message() << std::endl;
+                //    std::cout << "                            :ep   :" << endpoint << std::endl;
+                //}
+                if (!error) {
+                    self->configure();
+                    self->touch();
+                }
+                handler(error);
+            });
+        }
+
+        void async_connect(const _tcp::endpoint& endpoint, const std::function<void(std::error_code)>& handler)
+        {
+            // configured before connecting, for the buffer sizes to count in the handshake
+            auto error = asio::error_code{};
+            _socket.open(endpoint.protocol(), error);
+            if (error) return handler(error);
+            configure();
+
+            auto self(shared_from_this());
+            _socket.async_connect(endpoint, [self, handler](std::error_code error)
+            {
+                if (!error) self->touch();
+                handler(error);
+            });
+        }
+
+        void close()
+        {
+            _closed.store(true, std::memory_order_release);
+
+            auto self(shared_from_this());
+            asio::post(_socket.get_executor(), [self, this]() { close_socket(); });
+        }
+
+        bool is_open() const
+        {
+            return !_closed.load(std::memory_order_acquire);
+        }
+
+        void post(std::function<void()> task)
+        {
+            asio::post(_socket.get_executor(), std::move(task));
+        }
+
+        // Re-arm the idle timeout, from the io thread: once connected or accepted, then on traffic
+        void touch()
+        {
+            if (_timeouts.idle.count() && is_open()) _timers.schedule(deadlines().idle, _timeouts.idle);
+        }
+
+        // Call `expired` on the io thread unless cancel_dial_timer() comes first, from any thread
+        void start_dial_timer(std::chrono::milliseconds timeout, const std::function<void()>& expired)
+        {
+            std::weak_ptr<tcp_connection> weak = shared_from_this();
+            asio::dispatch(_socket.get_executor(), [weak, timeout, expired]()
+            {
+                auto self = weak.lock();
+                if (!self) return;
+
+                self->_timers.schedule(self->deadlines().dial, timeout, [weak, expired]() {
+                    if (weak.lock()) expired();
+                });
+            });
+        }
+
+        // From the io thread
+        void cancel_dial_timer()
+        {
+            if (_deadlines) _timers.cancel(_deadlines->dial);
+        }
+
+        void write(const multiformats::buffer_t& msg)
+        {
+            // the only copy of the message, into a pooled buffer
+            write(buffer_pool::global().copy(msg));
+        }
+
+        void write(const shared_buffer& msg)
+        {
+            _queued.fetch_add(msg.size(), std::memory_order_relaxed);
+
+            auto self(shared_from_this());
+            asio::post(_socket.get_executor(), [self, this, msg]() mutable
+            {
+                bool write_in_progress = !write_queue.empty();
+                write_queue.push_back({ std::move(msg), nullptr });
+                if (!write_in_progress)
+                {
+                    do_write();
+                }
+            });
+        }
+
+        bool try_write(const shared_buffer& msg)
+        {
+            if (_queued.load(std::memory_order_relaxed) >= _opts.high_watermark) return false;
+
+            write(msg);
+            return true;
+        }
+
+        void await_drain(const drain_handler_t& handler)
+        {
+            auto self(shared_from_this());
+            asio::post(_socket.get_executor(), [self, this, handler]()
+            {
+                if (!is_open()) return handler(asio::error::not_connected);
+                if (_queued.load(std::memory_order_relaxed) <= _opts.low_watermark) return handler({});
+
+                _drain_handlers.push_back(handler);
+            });
+        }
+
+        size_t queued_bytes() const
+        {
+            return _queued.load(std::memory_order_relaxed);
+        }
+
+#ifdef __linux__
+        void send_file(int fd, uint64_t offset, size_t length, const send_file_handler_t& handler)
+        {
+            _queued.fetch_add(length, std::memory_order_relaxed);
+
+            // the range takes its turn in the write queue
+            auto file = std::make_shared<file_range>(file_range{ fd, offset, length, 0, handler });
+            auto self(shared_from_this());
+            asio::post(_socket.get_executor(), [self, this, file]()
+            {
+                bool write_in_progress = !write_queue.empty();
+                write_queue.push_back({ shared_buffer{}, file });
+                if (!write_in_progress)
+                {
+                    do_write();
+                }
+            });
+        }
+#endif
+
+        void read(const read_handler_t& handler)
+        {
+            read(borrowed_read_handler_t{ [handler](std::error_code error, const borrowed_buffer& data) {
+                handler(error, multiformats::buffer_t{ data.begin(), data.end() });
+            } });
+        }
+
+        // A read started from another thread moves to the io thread first, where the timers are
+        void read(const borrowed_read_handler_t& handler)
+        {
+            auto self(shared_from_this());
+            asio::dispatch(_socket.get_executor(), [self, this, handler]() { start_read(handler); });
+        }
+
+        write_stats stats() const
+        {
+            return _counters.snapshot();
+        }
+
+    private:
+        // From the io thread
+        void start_read(const borrowed_read_handler_t& handler)
+        {
+            if (_timeouts.read.count()) _timers.schedule(deadlines().read, _timeouts.read);
+
+            auto self(shared_from_this());
+            _socket.async_read_some(_read_buffer.prepare(), [self, this, handler](std::error_code error, std::size_t length)
+            {
+                //{//DEBUG
+                //    std::cout << "tcp_connection:async_read:error :" << error.message() << std::endl;
+                //    std::cout << "                         :length:" << length << std::endl;
+                //}
+
+                if (_deadlines) _timers.cancel(_deadlines->read);
+
+                if (error) {
+                    if (_timed_out) error = asio::error::timed_out;
+                    close_socket();
+                    return handler(error, {});
+                }
+
+                touch();
+                if (_socket_opts.quick_ack) set_quick_ack(_socket.native_handle());
+
+                if (!_read_buffer.commit(length)) {
+                    // a small block filled up: read the rest of what came without waiting
+                    auto error = asio::error_code{};
+                    if (!_socket.non_blocking()) _socket.non_blocking(true, error);
+
+                    auto more = error ? 0 : _socket.read_some(_read_buffer.extend(), error);
+                    _read_buffer.complete(more);
+                }
+
+                handler({}, borrowed_buffer{ _read_buffer.buffer(), _read_buffer.buffer().size() });
+            });
+        }
+
+        // A file range queued by send_file
+        struct file_range {
+            int                 fd;
+            uint64_t            offset;
+            size_t              remaining;
+            size_t              sent;
+            send_file_handler_t handler;
+        };
+
+        // A message, or a file range when file is set
+        struct outgoing_t {
+            shared_buffer               msg;
+            std::shared_ptr<file_range> file;
+        };
+
+        // The timers of the connection, in the wheel of its io thread. They outlive the connection
+        //   until they are unlinked from the io thread: they only keep a weak reference to it.
+        struct deadlines_t {
+            explicit deadlines_t(const timer_wheel::callback_t& time_out)
+                : idle(time_out), read(time_out)
+            { }
+
+            void cancel(timer_service& timers)
+            {
+                timers.cancel(idle);
+                timers.cancel(read);
+                timers.cancel(dial);
+            }
+
+            timer_service::timer idle;
+            timer_service::timer read;
+            timer_service::timer dial;
+        };
+
+        // Get the timers, created on their first use from the io thread
+        deadlines_t& deadlines()
+        {
+            if (!_deadlines) {
+                std::weak_ptr<tcp_connection> weak = shared_from_this();
+                _deadlines = std::make_shared<deadlines_t>([weak]() {
+                    if (auto self = weak.lock()) self->time_out();
+                });
+            }
+            return *_deadlines;
+        }
+
+        // The idle or read timeout expired: the pending operations fail with timed_out
+        void time_out()
+        {
+            _timed_out = true;
+            close_socket();
+        }
+
+        // Close the socket, from the io thread
+        void close_socket()
+        {
+            _closed.store(true, std::memory_order_release);
+            _socket.close();
+
+            if (_deadlines) {
+                _timers.cancel(_deadlines->idle);
+                _timers.cancel(_deadlines->read);
+            }
+        }
+
+        // Send as many queued messages as the limits allow in a single gather write.
+        //   They stay in the queue until written: deque::push_back does not move them.
+        void do_write()
+        {
+            if (write_queue.front().file) return send_file_range();
+
+            _gather.clear();
+
+            auto bytes = size_t{ 0 };
+            for (auto& entry : write_queue) {
+                auto& msg = entry.msg;
+                if (entry.file) break;
+                if (_gather.size() >= std::max<size_t>(_opts.max_gather_buffers, 1)) break;
+                if (!_gather.empty() && bytes + msg.size() > _opts.max_gather_bytes) break;
+
+                _gather.push_back(asio::buffer(msg.data(), msg.size()));
+                bytes += msg.size();
+            }
+
+            auto self(shared_from_this());
+            asio::async_write(_socket, _gather, [self, this](std::error_code ec, std::size_t length)
+            {
+                if (!ec)
+                {
+                    _counters.record(_gather.size(), length);
+
+                    write_queue.erase(write_queue.begin(), write_queue.begin() + _gather.size());
+                    _queued.fetch_sub(length, std::memory_order_relaxed);
+                    touch();
+                    if (!write_queue.empty())
+                    {
+                        do_write();
+                    }
+
+                    if (_queued.load(std::memory_order_relaxed) <= _opts.low_watermark)
+                        drained({});
+                }
+                else
+                {
+                    drop_queue(ec);
+                }
+            });
+        }
+
+        // Nothing more will be sent: drop the queue, from the io thread
+        void drop_queue(std::error_code error)
+        {
+            if (_timed_out) error = asio::error::timed_out;
+            close_socket();
+
+            auto queue = std::move(write_queue);
+            write_queue.clear();
+            for (auto& entry : queue) {
+                _queued.fetch_sub(entry.file ? entry.file->remaining : entry.msg.size(), std::memory_order_relaxed);
+                if (entry.file) entry.file->handler(error, entry.file->sent);
+            }
+
+            drained(error);
+        }
+
+        // Send the file range at the front of the queue with sendfile: the bytes go from the page
+        //   cache to the socket without a copy through user space. A turn sends at most max_gather_bytes,
+        //   like a gather write, then lets the other handlers of the io thread run.
+        void send_file_range()
+        {
+#ifdef __linux__
+            // the queue was dropped meanwhile
+            if (write_queue.empty() || !write_queue.front().file) return;
+            auto& file = *write_queue.front().file;
+
+            auto error = asio::error_code{};
+            if (!_socket.native_non_blocking()) _socket.native_non_blocking(true, error);
+            if (error) return drop_queue(error);
+
+            auto budget = std::max<size_t>(_opts.max_gather_bytes, 1);
+            while (file.remaining && budget) {
+                auto offset = static_cast<off_t>(file.offset);
+                auto count = ::sendfile(_socket.native_handle(), file.fd, &offset, std::min(file.remaining, budget));
+
+                if (count < 0 && errno == EINTR) continue;
+                if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    // the socket buffer is full: go on once it is writable again
+                    auto self(shared_from_this());
+                    _socket.async_wait(_tcp::socket::wait_write, [self, this](std::error_code ec)
+                    {
+                        if (ec) return drop_queue(ec);
+                        send_file_range();
+                    });
+                    return;
+                }
+                if (count < 0) return drop_queue({ errno, std::system_category() });
+
+                // the range goes past the end of the file
+                if (count == 0) return drop_queue(std::make_error_code(std::errc::invalid_argument));
+
+                _counters.record(1, static_cast<size_t>(count));
+                file.offset += count;
+                file.remaining -= static_cast<size_t>(count);
+                file.sent += static_cast<size_t>(count);
+                _queued.fetch_sub(static_cast<size_t>(count), std::memory_order_relaxed);
+                budget -= static_cast<size_t>(count);
+                touch();
+            }
+
+            if (file.remaining) {
+                auto self(shared_from_this());
+                asio::post(_socket.get_executor(), [self, this]() { send_file_range(); });
+                return;
+            }
+
+            auto done = write_queue.front().file;
+            write_queue.pop_front();
+            done->handler({}, done->sent);
+
+            if (!write_queue.empty())
+            {
+                do_write();
+            }
+
+            if (_queued.load(std::memory_order_relaxed) <= _opts.low_watermark)
+                drained({});
+#endif
+        }
+
+        void drained(const std::error_code& error)
+        {
+            auto handlers = std::move(_drain_handlers);
+            _drain_handlers.clear();
+
+            for (auto& handler : handlers)
+                handler(error);
+        }
+
+    private:
+        sp_io_pool _pool;   // first: released last, once the socket and the timers are
+        _tcp::socket _socket;
+        std::atomic<bool> _closed{ false };
+        receive_buffer _read_buffer;
+        std::deque<outgoing_t> write_queue;
+        std::atomic<size_t> _queued{ 0 };
+        std::vector<drain_handler_t> _drain_handlers;
+
+        options::write_t _opts;
+        options::socket_t _socket_opts;
+        std::vector<asio::const_buffer> _gather;
+        write_counters _counters;
+
+        options::timeout_t _timeouts;
+        timer_service& _timers;
+        std::shared_ptr<deadlines_t> _deadlines;
+        bool _timed_out = false;
+    };
+
+}}
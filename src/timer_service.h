@@ -0,0 +1,87 @@
+#pragma once
+
+#include <p2p/utils/timer_wheel.h>
+
+#include "io_pool.h"
+
+#include <chrono>
+
+namespace p2p {
+
+    //
+    // timer_service runs the timer_wheel of an io_context with a single steady_timer, set for the next
+    //   slot of the wheel that holds timers: all the timeouts of an io thread cost one heap entry and
+    //   at most one wakeup per tick. It is used from the io thread of its context only.
+    //
+    class timer_service : public asio::execution_context::service
+    {
+    public:
+        using clock = timer_wheel::clock;
+        using timer = timer_wheel::timer;
+
+        static asio::execution_context::id id;
+
+        explicit timer_service(asio::execution_context& context, std::chrono::milliseconds tick = std::chrono::milliseconds{ 10 })
+            : asio::execution_context::service(context), _wheel(tick), _timer(static_cast<asio::io_context&>(context))
+        { }
+
+        // Arm or re-arm a timer with a new callback
+        void schedule(timer& t, clock::duration delay, const timer_wheel::callback_t& callback)
+        {
+            _wheel.schedule(t, clock::now() + delay, callback);
+            wake_for(t);
+        }
+
+        // Re-arm a timer with its last callback, without any allocation
+        void schedule(timer& t, clock::duration delay)
+        {
+            _wheel.schedule(t, clock::now() + delay);
+            wake_for(t);
+        }
+
+        void cancel(timer& t)
+        {
+            _wheel.cancel(t);
+        }
+
+        inline size_t size() const { return _wheel.size(); }
+
+    private:
+        void shutdown() { }
+
+        // Set the steady_timer earlier when the timer is due before it: re-arming a timer later, as
+        //   traffic does, leaves it alone and it wakes up early at worst
+        void wake_for(const timer& t)
+        {
+            auto deadline = _wheel.deadline(t);
+            if (!_waiting || deadline < _expiry) wait(deadline);
+        }
+
+        void wait(clock::time_point deadline)
+        {
+            _waiting = true;
+            _expiry = deadline;
+
+            // a wait set before is cancelled: its handler runs with operation_aborted
+            _timer.expires_at(deadline);
+            _timer.async_wait([this](const asio::error_code& error)
+            {
+                if (error) return;
+                _waiting = false;
+
+                // the callbacks may have armed timers, and set a wait for them
+                _wheel.advance(clock::now());
+                if (_wheel.empty()) return;
+
+                auto next = _wheel.next_deadline();
+                if (!_waiting || next < _expiry) wait(next);
+            });
+        }
+
+        timer_wheel        _wheel;
+        asio::steady_timer _timer;
+        bool               _waiting = false;
+        clock::time_point  _expiry;
+    };
+
+}
@@ -0,0 +1,883 @@
+#include <p2p/transports/uring.h>
+
+#ifdef P2P_HAS_IO_URING
+
+#include <liburing.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ASIO_STANDALONE
+#include <asio/error.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "socket_options.h"
+#include "write_counters.h"
+
+using namespace p2p;
+using namespace p2p::transports;
+using namespace multiformats;
+
+
+namespace {
+
+    // io_uring reports the errors as -errno
+    inline std::error_code uring_error(int res) { return { -res, std::system_category() }; }
+
+
+    //
+    // operation is the user_data of the submissions of a pending io_uring request.
+    //   It keeps its owner alive until its last completion; the worker tracks the pending
+    //   operations to release their owners when it stops.
+    //
+    struct operation {
+        virtual ~operation() = default;
+        virtual void complete(int res, unsigned flags) = 0;
+
+        std::shared_ptr<void> owner;
+        operation* prev = nullptr;
+        operation* next = nullptr;
+    };
+
+
+    //
+    // ring_worker runs one io_uring on its own thread, with a ring of provided receive buffers.
+    //   Other threads hand it tasks through a queue, and wake it up with an eventfd whose read
+    //   is kept pending on the ring.
+    //
+    class ring_worker : private operation
+    {
+    public:
+        static const int buffer_group = 0;
+
+        ring_worker(const options::uring_t& opts)
+            : _opts(opts), _mask(io_uring_buf_ring_mask(opts.buffers)), _stopping(false)
+        {
+            // the ring is set up by its thread: it is the only one submitting to it
+            auto ready = std::promise<std::error_code>();
+            _thread = std::thread([this, &ready]() { run(ready); });
+
+            auto error = ready.get_future().get();
+            if (error) {
+                _thread.join();
+                throw std::system_error(error, "io_uring");
+            }
+        }
+
+        ~ring_worker()
+        {
+            stop();
+            ::close(_event_fd);
+        }
+
+        inline bool on_thread() const { return std::this_thread::get_id() == _thread.get_id(); }
+
+        // Run the task on the thread of the ring
+        void post(std::function<void()> task)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto wake = _tasks.empty();
+            _tasks.push_back(std::move(task));
+            lock.unlock();
+
+            if (wake) eventfd_write(_event_fd, 1);
+        }
+
+        // Run the task now when called from the thread of the ring, post it otherwise
+        void dispatch(std::function<void()> task)
+        {
+            if (on_thread()) task();
+            else post(std::move(task));
+        }
+
+        // Get a submission entry for the operation, flushing the queue when it is full: a chain of
+        //   linked submissions reserves its entries first, a flush in its middle would break the link
+        io_uring_sqe* sqe(operation* op)
+        {
+            auto sqe = io_uring_get_sqe(&_ring);
+            while (!sqe) {
+                io_uring_submit(&_ring);
+                sqe = io_uring_get_sqe(&_ring);
+            }
+            io_uring_sqe_set_data(sqe, op);
+            return sqe;
+        }
+
+        // Make room for a chain of linked submissions, at most capacity()
+        void reserve(unsigned count)
+        {
+            if (io_uring_sq_space_left(&_ring) < count) io_uring_submit(&_ring);
+        }
+
+        inline unsigned capacity() const { return _opts.queue_depth; }
+
+        // Track an operation just submitted, until finish()
+        void start(operation* op, std::shared_ptr<void> owner)
+        {
+            op->owner = std::move(owner);
+            op->prev = nullptr;
+            op->next = _pending;
+            if (_pending) _pending->prev = op;
+            _pending = op;
+        }
+
+        // Stop tracking an operation: its owner is released when the returned handle goes away
+        std::shared_ptr<void> finish(operation* op)
+        {
+            if (op->prev) op->prev->next = op->next;
+            else _pending = op->next;
+            if (op->next) op->next->prev = op->prev;
+
+            op->prev = op->next = nullptr;
+            return std::move(op->owner);
+        }
+
+        // The provided buffer picked by the kernel for a receive
+        inline const shared_buffer& buffer(unsigned id) const { return _buffers[id]; }
+
+        // Give a provided buffer back to the kernel; one retained by a read handler is replaced first
+        void recycle(unsigned id)
+        {
+            if (!_buffers[id].unique())
+                _buffers[id] = buffer_pool::global().allocate(_opts.buffer_size);
+
+            io_uring_buf_ring_add(_buf_ring, _buffers[id].data(), static_cast<unsigned>(_opts.buffer_size), static_cast<unsigned short>(id), _mask, 0);
+            io_uring_buf_ring_advance(_buf_ring, 1);
+        }
+
+        void stop()
+        {
+            if (!_thread.joinable()) return;
+
+            _stopping = true;
+            eventfd_write(_event_fd, 1);
+            _thread.join();
+        }
+
+        // Stop from the thread of the ring, which cannot join itself: the worker deletes itself once
+        //   its loop is over
+        void stop_and_delete()
+        {
+            _delete_on_exit = true;
+            _stopping = true;
+            _thread.detach();
+        }
+
+    private:
+        void run(std::promise<std::error_code>& ready)
+        {
+            if (auto error = setup()) return ready.set_value(error);
+            ready.set_value({});
+
+            arm_wakeup();
+            while (!_stopping) {
+                io_uring_submit_and_wait(&_ring, 1);
+
+                auto head = unsigned{ 0 };
+                auto count = unsigned{ 0 };
+                io_uring_cqe* cqe;
+                io_uring_for_each_cqe(&_ring, head, cqe) {
+                    // completions without operation come from fire-and-forget requests (cancels)
+                    if (auto op = static_cast<operation*>(io_uring_cqe_get_data(cqe)))
+                        op->complete(cqe->res, cqe->flags);
+                    count++;
+                }
+                io_uring_cq_advance(&_ring, count);
+
+                run_tasks();
+            }
+
+            teardown();
+            if (_delete_on_exit) delete this;
+        }
+
+        std::error_code setup()
+        {
+            _event_fd = eventfd(0, EFD_CLOEXEC);
+            if (_event_fd < 0) return { errno, std::system_category() };
+
+            auto params = io_uring_params{};
+            params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+            auto res = io_uring_queue_init_params(_opts.queue_depth, &_ring, &params);
+            if (res == -EINVAL) {
+                // older kernel: without the single issuer optimizations
+                params = io_uring_params{};
+                res = io_uring_queue_init_params(_opts.queue_depth, &_ring, &params);
+            }
+            if (res < 0) {
+                ::close(_event_fd);
+                return uring_error(res);
+            }
+
+            // the pooled buffers are lent to the read handlers without copy, like the asio receive buffers
+            _buf_ring = io_uring_setup_buf_ring(&_ring, _opts.buffers, buffer_group, 0, &res);
+            if (!_buf_ring) {
+                io_uring_queue_exit(&_ring);
+                ::close(_event_fd);
+                return uring_error(res);
+            }
+
+            _buffers.resize(_opts.buffers);
+            for (auto id = unsigned{ 0 }; id < _opts.buffers; id++) {
+                _buffers[id] = buffer_pool::global().allocate(_opts.buffer_size);
+                io_uring_buf_ring_add(_buf_ring, _buffers[id].data(), static_cast<unsigned>(_opts.buffer_size), static_cast<unsigned short>(id), _mask, id);
+            }
+            io_uring_buf_ring_advance(_buf_ring, _opts.buffers);
+
+            return {};
+        }
+
+        void teardown()
+        {
+            io_uring_free_buf_ring(&_ring, _buf_ring, _opts.buffers, buffer_group);
+            io_uring_queue_exit(&_ring);
+
+            // the requests still pending never complete: release their owners
+            while (_pending) {
+                auto owner = finish(_pending);
+            }
+
+            _buffers.clear();
+        }
+
+        void arm_wakeup()
+        {
+            io_uring_prep_read(sqe(this), _event_fd, &_event_value, sizeof(_event_value), 0);
+        }
+
+        // eventfd read completion
+        void complete(int /*res*/, unsigned /*flags*/)
+        {
+            if (!_stopping) arm_wakeup();
+        }
+
+        void run_tasks()
+        {
+            for (;;) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_tasks.empty()) return;
+                auto tasks = std::move(_tasks);
+                _tasks.clear();
+                lock.unlock();
+
+                for (auto& task : tasks)
+                    task();
+            }
+        }
+
+    private:
+        options::uring_t            _opts;
+        io_uring                    _ring;
+        io_uring_buf_ring*          _buf_ring = nullptr;
+        std::vector<shared_buffer>  _buffers;
+        int                         _mask;
+
+        int                         _event_fd = -1;
+        eventfd_t                   _event_value = 0;
+
+        std::mutex                  _mutex;
+        std::vector<std::function<void()>> _tasks;
+
+        operation*                  _pending = nullptr;
+        std::atomic<bool>           _stopping;
+        bool                        _delete_on_exit = false;
+        std::thread                 _thread;
+    };
+
+
+    // Parse a literal /ip4 or /ip6 multiaddr into a socket address
+    bool to_sockaddr(const multiaddr& ma, sockaddr_storage& addr, socklen_t& length)
+    {
+        auto host = ma[0].str();
+        auto port = static_cast<uint16_t>(std::stoi(ma[1].str()));
+
+        std::memset(&addr, 0, sizeof(addr));
+        if (ma[0].addr() == ip4) {
+            auto in = reinterpret_cast<sockaddr_in*>(&addr);
+            in->sin_family = AF_INET;
+            in->sin_port = htons(port);
+            length = sizeof(sockaddr_in);
+            return inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1;
+        }
+        if (ma[0].addr() == ip6) {
+            auto in6 = reinterpret_cast<sockaddr_in6*>(&addr);
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(port);
+            length = sizeof(sockaddr_in6);
+            return inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1;
+        }
+        return false;
+    }
+
+    multiaddr to_multiaddr(const sockaddr_storage& addr)
+    {
+        char host[INET6_ADDRSTRLEN] = {};
+        if (addr.ss_family == AF_INET6) {
+            auto in6 = reinterpret_cast<const sockaddr_in6*>(&addr);
+            inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+            return { std::string{ "/ip6/" } + host + "/tcp/" + std::to_string(ntohs(in6->sin6_port)) };
+        }
+        auto in = reinterpret_cast<const sockaddr_in*>(&addr);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        return { std::string{ "/ip4/" } + host + "/tcp/" + std::to_string(ntohs(in->sin_port)) };
+    }
+}
+
+
+//
+// uring_runtime owns the rings of a transport, handed out round-robin to the connections.
+//   The transport shares it with its connections and listeners, and the last one may be released
+//   by a handler, on a ring.
+//
+class p2p::transports::uring_runtime
+{
+public:
+    uring_runtime(const options& opts)
+        : _next(0)
+    {
+        auto count = opts.io.threads ? opts.io.threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        for (auto i = size_t{ 0 }; i < count; i++)
+            _workers.emplace_back(new ring_worker(opts.uring));
+    }
+
+    ~uring_runtime()
+    {
+        // the other rings are joined
+        for (auto& worker : _workers)
+            if (worker->on_thread()) worker.release()->stop_and_delete();
+    }
+
+    ring_worker& next() { return *_workers[_next++ % _workers.size()]; }
+
+    inline ring_worker& at(size_t index) { return *_workers[index]; }
+    inline size_t       size() const     { return _workers.size(); }
+
+private:
+    std::vector<std::unique_ptr<ring_worker>> _workers;
+    std::atomic<size_t>                       _next;
+};
+
+
+namespace {
+
+    //
+    // uring_connection is a TCP connection bound to one ring.
+    //   All its requests are submitted from the thread of the ring, which runs its handlers.
+    //
+    class uring_connection : public connection, public std::enable_shared_from_this<uring_connection>
+    {
+    public:
+        uring_connection(const std::shared_ptr<uring_runtime>& runtime, ring_worker& worker, int fd, const options& opts)
+            : _runtime(runtime), _worker(worker), _fd(fd), _opts(opts.write), _fallback_size(opts.read.initial_buffer), _quick_ack(opts.socket.quick_ack)
+        {
+            _recv.conn = this;
+            _send.conn = this;
+            _connect.conn = this;
+        }
+
+        ~uring_connection()
+        {
+            ::close(_fd);
+        }
+
+        ring_worker& worker() { return _worker; }
+
+        void connect(const sockaddr_storage& addr, socklen_t length, const std::function<void(std::error_code)>& handler)
+        {
+            auto self(shared_from_this());
+            _worker.dispatch([self, this, addr, length, handler]() {
+                if (!is_open()) return handler(std::make_error_code(std::errc::operation_canceled));
+
+                // the address must stay valid until the request is issued
+                _connect.addr = addr;
+                _connect.handler = handler;
+                io_uring_prep_connect(_worker.sqe(&_connect), _fd, reinterpret_cast<const sockaddr*>(&_connect.addr), length);
+                _worker.start(&_connect, self);
+            });
+        }
+
+        void close()
+        {
+            _closed.store(true, std::memory_order_release);
+
+            auto self(shared_from_this());
+            _worker.dispatch([self, this]() { close_socket(); });
+        }
+
+        bool is_open() const
+        {
+            return !_closed.load(std::memory_order_acquire);
+        }
+
+        void post(std::function<void()> task)
+        {
+            _worker.post(std::move(task));
+        }
+
+        void write(const multiformats::buffer_t& msg)
+        {
+            // the only copy of the message, into a pooled buffer
+            write(buffer_pool::global().copy(msg));
+        }
+
+        void write(const shared_buffer& msg)
+        {
+            _queued.fetch_add(msg.size(), std::memory_order_relaxed);
+
+            auto self(shared_from_this());
+            _worker.dispatch([self, this, msg]() {
+                _write_queue.push_back({ msg, 0 });
+                if (!_send.pending) send_chain();
+            });
+        }
+
+        bool try_write(const shared_buffer& msg)
+        {
+            if (_queued.load(std::memory_order_relaxed) >= _opts.high_watermark) return false;
+
+            write(msg);
+            return true;
+        }
+
+        void await_drain(const drain_handler_t& handler)
+        {
+            auto self(shared_from_this());
+            _worker.dispatch([self, this, handler]() {
+                if (!is_open()) return handler(std::make_error_code(std::errc::not_connected));
+                if (_queued.load(std::memory_order_relaxed) <= _opts.low_watermark) return handler({});
+
+                _drain_handlers.push_back(handler);
+            });
+        }
+
+        size_t queued_bytes() const
+        {
+            return _queued.load(std::memory_order_relaxed);
+        }
+
+        void read(const read_handler_t& handler)
+        {
+            read(borrowed_read_handler_t{ [handler](std::error_code error, const borrowed_buffer& data) {
+                handler(error, multiformats::buffer_t{ data.begin(), data.end() });
+            } });
+        }
+
+        void read(const borrowed_read_handler_t& handler)
+        {
+            auto self(shared_from_this());
+            _worker.dispatch([self, this, handler]() {
+                if (!is_open()) return handler(std::make_error_code(std::errc::not_connected), {});
+
+                _recv.handler = handler;
+                submit_recv(false);
+            });
+        }
+
+        write_stats stats() const
+        {
+            return _counters.snapshot();
+        }
+
+    private:
+        struct recv_op : operation {
+            uring_connection*       conn;
+            borrowed_read_handler_t handler;
+            bool                    fallback = false;
+            void complete(int res, unsigned flags) { conn->on_recv(res, flags); }
+        };
+
+        struct send_op : operation {
+            uring_connection* conn;
+            size_t            pending = 0;  // sends of the chain not completed yet
+            size_t            index = 0;    // message of the next completion
+            int               error = 0;
+            void complete(int res, unsigned flags) { conn->on_send(res, flags); }
+        };
+
+        struct connect_op : operation {
+            uring_connection*                    conn;
+            sockaddr_storage                     addr;
+            std::function<void(std::error_code)> handler;
+            void complete(int res, unsigned flags) { conn->on_connect(res, flags); }
+        };
+
+        struct message_t {
+            shared_buffer buffer;
+            size_t        offset;  // bytes already sent
+        };
+
+        void close_socket()
+        {
+            _closed.store(true, std::memory_order_release);
+
+            // wake up the pending requests: shutdown ends the receives, the cancel ends a connect
+            ::shutdown(_fd, SHUT_RDWR);
+            io_uring_prep_cancel_fd(_worker.sqe(nullptr), _fd, IORING_ASYNC_CANCEL_ALL);
+        }
+
+        // Receive into a provided buffer, or into a buffer of our own when the ring ran out of them
+        void submit_recv(bool fallback)
+        {
+            auto sqe = _worker.sqe(&_recv);
+            _recv.fallback = fallback;
+
+            if (fallback) {
+                if (!_fallback.unique()) _fallback = buffer_pool::global().allocate(_fallback_size);
+                io_uring_prep_recv(sqe, _fd, _fallback.data(), _fallback.capacity(), 0);
+            }
+            else {
+                io_uring_prep_recv(sqe, _fd, nullptr, 0, 0);
+                io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+                sqe->buf_group = ring_worker::buffer_group;
+            }
+            _worker.start(&_recv, shared_from_this());
+        }
+
+        void on_recv(int res, unsigned flags)
+        {
+            auto owner = _worker.finish(&_recv);
+
+            if (res == -ENOBUFS && is_open()) return submit_recv(true);
+
+            auto handler = std::move(_recv.handler);
+            _recv.handler = nullptr;
+
+            if (res <= 0) {
+                close_socket();
+                // 0: the peer closed the connection, an end of file like for the asio connections
+                return handler(res ? uring_error(res) : std::error_code{ asio::error::eof }, {});
+            }
+
+            if (_quick_ack) set_quick_ack(_fd);
+
+            if (_recv.fallback) {
+                _fallback.resize(res);
+                return handler({}, borrowed_buffer{ _fallback, static_cast<size_t>(res) });
+            }
+
+            auto id = flags >> IORING_CQE_BUFFER_SHIFT;
+            handler({}, borrowed_buffer{ _worker.buffer(id), static_cast<size_t>(res) });
+            _worker.recycle(id);
+        }
+
+        // Send the queued messages as a chain of linked sends, within the gather limits
+        void send_chain()
+        {
+            if (_write_queue.empty()) return;
+
+            // the whole chain goes in one submission
+            auto limit = std::min<size_t>(std::max<size_t>(_opts.max_gather_buffers, 1), _worker.capacity());
+
+            auto count = size_t{ 0 };
+            auto bytes = size_t{ 0 };
+            for (auto& msg : _write_queue) {
+                auto size = msg.buffer.size() - msg.offset;
+                if (count >= limit) break;
+                if (count && bytes + size > _opts.max_gather_bytes) break;
+                count++;
+                bytes += size;
+            }
+
+            _worker.reserve(static_cast<unsigned>(count));
+            for (auto i = size_t{ 0 }; i < count; i++) {
+                auto& msg = _write_queue[i];
+                auto sqe = _worker.sqe(&_send);
+
+                // MSG_WAITALL: the kernel retries a short send instead of breaking the chain
+                io_uring_prep_send(sqe, _fd, msg.buffer.data() + msg.offset, msg.buffer.size() - msg.offset, MSG_WAITALL | MSG_NOSIGNAL);
+                if (i + 1 < count) io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            }
+
+            _send.pending = count;
+            _send.index = 0;
+            _send.error = 0;
+            _worker.start(&_send, shared_from_this());
+        }
+
+        // The sends of a chain complete in order; the chain is over once they all did
+        void on_send(int res, unsigned /*flags*/)
+        {
+            if (res >= 0) _write_queue[_send.index].offset += res;
+            else if (res != -ECANCELED && !_send.error) _send.error = res;
+
+            _send.index++;
+            if (--_send.pending) return;
+
+            auto owner = _worker.finish(&_send);
+
+            auto messages = size_t{ 0 };
+            auto bytes = size_t{ 0 };
+            while (!_write_queue.empty() && _write_queue.front().offset == _write_queue.front().buffer.size()) {
+                bytes += _write_queue.front().buffer.size();
+                messages++;
+                _write_queue.pop_front();
+            }
+            if (messages) _counters.record(messages, bytes);
+            _queued.fetch_sub(bytes, std::memory_order_relaxed);
+
+            if (_send.error || !is_open()) {
+                // nothing more will be sent: drop the queue
+                close_socket();
+                for (auto& msg : _write_queue)
+                    _queued.fetch_sub(msg.buffer.size(), std::memory_order_relaxed);
+                _write_queue.clear();
+
+                return drained(_send.error ? uring_error(_send.error) : std::make_error_code(std::errc::not_connected));
+            }
+
+            // what a broken chain did not send goes into the next one
+            send_chain();
+
+            if (_queued.load(std::memory_order_relaxed) <= _opts.low_watermark)
+                drained({});
+        }
+
+        void on_connect(int res, unsigned /*flags*/)
+        {
+            auto owner = _worker.finish(&_connect);
+
+            auto handler = std::move(_connect.handler);
+            _connect.handler = nullptr;
+            handler(res < 0 ? uring_error(res) : std::error_code{});
+        }
+
+        void drained(const std::error_code& error)
+        {
+            auto handlers = std::move(_drain_handlers);
+            _drain_handlers.clear();
+
+            for (auto& handler : handlers)
+                handler(error);
+        }
+
+    private:
+        std::shared_ptr<uring_runtime> _runtime;
+        ring_worker&                 _worker;
+        int                          _fd;
+        std::atomic<bool>            _closed{ false };
+        options::write_t             _opts;
+
+        recv_op                      _recv;
+        shared_buffer                _fallback;
+        size_t                       _fallback_size;
+        bool                         _quick_ack;
+
+        send_op                      _send;
+        std::deque<message_t>        _write_queue;
+        std::atomic<size_t>          _queued{ 0 };
+        std::vector<drain_handler_t> _drain_handlers;
+        write_counters               _counters;
+
+        connect_op                   _connect;
+    };
+}
+
+
+namespace {
+
+    //
+    // uring_listener accepts the connections of each address with a multishot accept on a ring.
+    //   With options::listen.reuse_port, every ring gets its own SO_REUSEPORT socket and keeps the
+    //   connections it accepts, otherwise they are spread over the rings.
+    //
+    class uring_listener : public listener, public std::enable_shared_from_this<uring_listener>
+    {
+    public:
+        uring_listener(const std::shared_ptr<uring_runtime>& runtime, const options& opts, const handler_t& handler)
+            : _runtime(runtime), _opts(opts), _handler(handler)
+        { }
+
+        ~uring_listener()
+        {
+            for (auto& acceptor : _acceptors)
+                if (acceptor->fd >= 0) ::close(acceptor->fd);
+        }
+
+        multiaddr listen(const multiaddr& ma)
+        {
+            auto addr = sockaddr_storage{};
+            auto length = socklen_t{ 0 };
+            if (!to_sockaddr(ma, addr, length)) throw std::invalid_argument("must be IPv4 or IPv6 multiaddr");
+
+            auto sharded = _opts.listen.reuse_port && _runtime->size() > 1;
+            auto count = sharded ? _runtime->size() : 1;
+
+            for (auto i = size_t{ 0 }; i < count; i++) {
+                auto fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+                if (fd < 0) throw std::system_error(errno, std::system_category(), "socket");
+
+                auto acceptor = std::make_unique<accept_op>();
+                acceptor->fd = fd;
+                acceptor->listener = this;
+                acceptor->worker = &_runtime->at(i);
+                acceptor->sharded = sharded;
+                _acceptors.push_back(std::move(acceptor));
+
+                auto on = 1;
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                if (sharded) ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+                // inherited by the accepted sockets
+                set_buffer_sizes(fd, _opts.socket);
+
+                if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), length) < 0) throw std::system_error(errno, std::system_category(), "bind");
+                if (::listen(fd, SOMAXCONN) < 0) throw std::system_error(errno, std::system_category(), "listen");
+
+                // when port 0 was requested, the next shards bind to the one picked for the first
+                ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length);
+            }
+
+            auto self(shared_from_this());
+            for (auto i = _acceptors.size() - count; i < _acceptors.size(); i++) {
+                auto acceptor = _acceptors[i].get();
+                acceptor->worker->dispatch([self, acceptor]() { self->accept(acceptor); });
+            }
+
+            return to_multiaddr(addr);
+        }
+
+        void close()
+        {
+            auto self(shared_from_this());
+            for (auto& acceptor : _acceptors) {
+                auto op = acceptor.get();
+                op->worker->dispatch([self, op]() {
+                    op->closed = true;
+                    io_uring_prep_cancel_fd(op->worker->sqe(nullptr), op->fd, IORING_ASYNC_CANCEL_ALL);
+                });
+            }
+        }
+
+    private:
+        struct accept_op : operation {
+            uring_listener* listener;
+            ring_worker*    worker;
+            int             fd = -1;
+            bool            sharded = false;
+            bool            closed = false;
+
+            // waiting for listen.accept_retry after an accept failed
+            bool              retrying = false;
+            __kernel_timespec delay;
+
+            void complete(int res, unsigned flags)
+            {
+                if (!retrying) return listener->on_accept(this, res, flags);
+
+                retrying = false;
+                auto owner = worker->finish(this);
+                listener->accept(this);
+            }
+        };
+
+        void accept(accept_op* op)
+        {
+            if (op->closed) return;
+
+            io_uring_prep_multishot_accept(op->worker->sqe(op), op->fd, nullptr, nullptr, SOCK_CLOEXEC);
+            op->worker->start(op, shared_from_this());
+        }
+
+        void on_accept(accept_op* op, int res, unsigned flags)
+        {
+            // the multishot accept stays armed while the completions carry IORING_CQE_F_MORE
+            auto owner = std::shared_ptr<void>{};
+            if (!(flags & IORING_CQE_F_MORE)) owner = op->worker->finish(op);
+
+            if (res >= 0) {
+                set_socket_options(res, _opts.socket);
+
+                auto& worker = op->sharded ? *op->worker : _runtime->next();
+                auto conn = std::make_shared<uring_connection>(_runtime, worker, res, _opts);
+
+                // the connection runs on its own ring
+                auto handler = _handler;
+                worker.dispatch([handler, conn]() { if (handler) handler(conn); });
+            }
+
+            if (flags & IORING_CQE_F_MORE) return;
+
+            // an accept that failed (e.g. EMFILE) is not armed again at once, it would fail in a loop
+            if (res < 0) retry(op);
+            else accept(op);
+        }
+
+        // Accept again after a delay, like the asio listener, until the listener is closed
+        void retry(accept_op* op)
+        {
+            if (op->closed) return;
+
+            auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(_opts.listen.accept_retry).count();
+            op->delay.tv_sec = delay / 1000000000;
+            op->delay.tv_nsec = delay % 1000000000;
+            op->retrying = true;
+
+            io_uring_prep_timeout(op->worker->sqe(op), &op->delay, 0, 0);
+            op->worker->start(op, shared_from_this());
+        }
+
+    private:
+        std::shared_ptr<uring_runtime>          _runtime;
+        options                                 _opts;
+        handler_t                               _handler;
+        std::vector<std::unique_ptr<accept_op>> _acceptors;
+    };
+}
+
+
+p2p::transports::uring::uring(const options& opts)
+    : _runtime(std::make_shared<uring_runtime>(opts)), _opts(opts)
+{ }
+
+p2p::transports::uring::~uring() = default;
+
+std::shared_ptr<connection> p2p::transports::uring::dial(const multiaddr& ma, const dial_handler_t& handler)
+{
+    auto& worker = _runtime->next();
+
+    auto addr = sockaddr_storage{};
+    auto length = socklen_t{ 0 };
+    if (!to_sockaddr(ma, addr, length)) {
+        worker.post([handler]() { handler(std::make_error_code(std::errc::address_family_not_supported), nullptr); });
+        return nullptr;
+    }
+
+    auto fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+        auto error = std::error_code{ errno, std::system_category() };
+        worker.post([handler, error]() { handler(error, nullptr); });
+        return nullptr;
+    }
+
+    // Linux takes all the options before the connection
+    set_socket_options(fd, _opts.socket);
+
+    auto conn = std::make_shared<uring_connection>(_runtime, worker, fd, _opts);
+    conn->connect(addr, length, [conn, handler](std::error_code error) {
+        return error ? handler(error, nullptr) : handler({}, conn);
+    });
+    return conn;
+}
+
+sp_listener p2p::transports::uring::create_listener(const listener::handler_t& handler)
+{
+    return std::make_shared<uring_listener>(_runtime, _opts, handler);
+}
+
+bool p2p::transports::uring::match(const multiformats::multiaddr& addr) const
+{
+    if (addr.has(p2p_circuit)) return false;
+    return is_tcp(addr.decapsulate(ipfs));
+}
+
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <p2p/connection.h>
+
+#include <array>
+#include <atomic>
+#include <tuple>
+
+namespace p2p {
+
+    // Write counters, updated by the io thread and read from any thread
+    class write_counters
+    {
+    public:
+        void record(size_t messages, size_t bytes)
+        {
+            _writes.fetch_add(1, std::memory_order_relaxed);
+            _messages.fetch_add(messages, std::memory_order_relaxed);
+            _bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+            if (messages > _max_messages.load(std::memory_order_relaxed))
+                _max_messages.store(messages, std::memory_order_relaxed);
+
+            auto bucket = size_t{ 0 };
+            while ((messages >>= 1) && bucket < _batches.size() - 1) bucket++;
+            _batches[bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        write_stats snapshot() const
+        {
+            auto stats = write_stats{};
+            stats.writes = _writes.load(std::memory_order_relaxed);
+            stats.messages = _messages.load(std::memory_order_relaxed);
+            stats.bytes = _bytes.load(std::memory_order_relaxed);
+            stats.max_messages = _max_messages.load(std::memory_order_relaxed);
+            for (auto i = size_t{ 0 }; i < _batches.size(); i++)
+                stats.batches[i] = _batches[i].load(std::memory_order_relaxed);
+            return stats;
+        }
+
+    private:
+        std::atomic<uint64_t> _writes{ 0 };
+        std::atomic<uint64_t> _messages{ 0 };
+        std::atomic<uint64_t> _bytes{ 0 };
+        std::atomic<uint64_t> _max_messages{ 0 };
+        std::array<std::atomic<uint64_t>, std::tuple_size<decltype(write_stats::batches)>::value> _batches{};
+    };
+
+}